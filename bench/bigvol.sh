@@ -0,0 +1,82 @@
+#!/bin/sh
+# Check a volume bigger than 4G: make a sparse 12G partition image, copy three 1.9G files and a directory of 2000
+# small files onto it with -a size (which puts the large files at the top of the volume, above 8G), then check it with
+# fst and inspect. fst is built from fst/src. Passes if fst check reports nothing it didn't already report for the empty
+# volume, every file copied back out with fst matches the original, the large files start above 8G and the directory's
+# DIRBLKs above 4G (the DIRBLK band is in the middle), and inspect sees functional version 3. Needs about
+# 12 GB free in <dir>, which is removed afterwards. Build with make.sh first, and run from the top of the repository.
+set -e
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 <dir>" >&2
+    exit 1
+fi
+work=$1/bigvol.$$
+top=$(pwd)
+mkdir -p "$work/tree/small"
+trap 'rm -rf "$work"' EXIT
+cp -r fst/src "$work/fst"
+mkdir -p "$work/fst/unix"
+# fst leaves out HPFS unless asked
+(cd "$work/fst" && make -f unix.mak DO_HPFS_OBJ=unix/do_hpfs.o \
+    CC="gcc -O2 -w -DHPFS -DOS2_EMULATE -D_FILE_OFFSET_BITS=64" > /dev/null 2>&1)
+fst=$work/fst/unix/fst
+for f in 0 1 2; do
+    head -c 1900M /dev/urandom > "$work/tree/big$f"
+done
+for f in $(seq 0 1999); do
+    head -c $(( f * 2654435761 % 8192 )) /dev/urandom > "$work/tree/small/f$f.dat"
+done
+# mkhpfs copies the jump and the signature from a boot block, and hpfsimg won't open the image without them
+{ printf '\353\074\220'; head -c 507 /dev/zero; printf '\125\252'; } > "$work/boot"
+img=$work/hpfs.img
+./mkhpfs -b "$work/boot" -S 12G "$img" > /dev/null 2>&1
+# Prints what fst check finds wrong with the image. hpfsimg leaves the DIRBLK band's own sectors marked used in its
+# bitmap and doesn't fill in truncated names, on any size of volume, so fst's complaints about those are left out.
+check() {
+    "$fst" check "$img" < /dev/null 2>&1 | grep -v "used as DIRBLK band\|Wrong truncated name\|^Total\|^$" || true
+}
+check > "$work/empty.txt"
+if grep -q "not supported" "$work/empty.txt"; then
+    cat "$work/empty.txt"
+    exit 1
+fi
+./hpfsimg -i -a size -d "$work/tree" "$img" > /dev/null 2>&1
+fail=0
+check > "$work/full.txt"
+if ! diff "$work/empty.txt" "$work/full.txt" > /dev/null; then
+    echo "fst check found new problems:"
+    diff "$work/empty.txt" "$work/full.txt" | sed -n 's/^> //p' | head -20
+    fail=1
+fi
+bad=0
+cd "$work/tree"
+for f in big* small/*; do
+    rm -f "$work/out"
+    "$fst" copy "$img" "\\$(echo "$f" | tr / '\\')" "$work/out" < /dev/null > /dev/null 2>&1 || true
+    if ! cmp -s "$f" "$work/out"; then
+        [ $bad -lt 5 ] && echo "Mismatch: $f"
+        bad=$((bad + 1))
+    fi
+done
+cd "$top"
+if [ $bad -ne 0 ]; then
+    echo "$bad of 2003 files don't match"
+    fail=1
+fi
+# fst info prints the sector of each run of a file's data, and of the DIRBLK a directory's entry is in
+if ! "$fst" info "$img" '\big0' < /dev/null 2> /dev/null |
+    awk '/File data/ { sub("#", "", $6); if ($6 + 0 < 16777216) exit 1 }'; then
+    echo "big0 isn't above 8G"
+    fail=1
+fi
+if ! "$fst" info "$img" '\small\f0.dat' < /dev/null 2> /dev/null |
+    awk '/^Directory entry/ { sub("#", "", $6); if ($6 + 0 < 8388608) exit 1 }'; then
+    echo "small isn't above 4G"
+    fail=1
+fi
+if ! ./inspect -i "$img" | grep -q "Functional version: 3"; then
+    echo "inspect doesn't report functional version 3"
+    fail=1
+fi
+[ $fail -eq 0 ] && echo "OK"
+exit $fail
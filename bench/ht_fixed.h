@@ -0,0 +1,88 @@
+// hpfsimg's original metadata hash table (as of the baseline), for htbench.c. 1024 buckets, each of which tries two
+// slots and then chains everything else off the second one. The hash is kept exactly as it was, precedence bug and all.
+
+struct ht_entry {
+    uint32_t sector;
+    int type;
+    void* data;
+
+    void* next;
+};
+
+#define HASHING_ATTEMPTS 2
+#define HASHTABLE_ENTRIES (1024)
+static inline uint32_t hash_value(uint32_t key)
+{
+    return (key << 3 + key >> 2 + key) & (HASHTABLE_ENTRIES - 1); // random hash idea idk
+}
+static struct ht_entry* ht;
+static void ht_init(void)
+{
+    ht = malloc(HASHTABLE_ENTRIES * sizeof(struct ht_entry));
+    for (int i = 0; i < HASHTABLE_ENTRIES; i++) {
+        ht[i].sector = ht[i].type = SECTOR_ENTRY_NONE;
+        ht[i].next = NULL;
+    }
+}
+
+static void ht_add(uint32_t sector, int type, void* data)
+{
+    int hash = sector;
+    for (int i = 0; i < HASHING_ATTEMPTS; i++) {
+        hash = hash_value(hash);
+        if (ht[hash].sector == 0) {
+            // we have found an open spot
+            ht[hash].sector = sector;
+            ht[hash].type = type;
+            ht[hash].data = data;
+            ht[hash].next = NULL;
+            return;
+        }
+    }
+
+    // linked list time
+    struct ht_entry *hte = &ht[hash], *next;
+    while (hte->next)
+        hte = hte->next;
+    next = malloc(sizeof(struct ht_entry));
+    next->data = data;
+    next->next = NULL;
+    next->sector = sector;
+    next->type = type;
+    hte->next = next;
+    return;
+}
+
+static void* ht_get(uint32_t sector, int type)
+{
+    int hash = sector;
+    for (int i = 0; i < HASHING_ATTEMPTS; i++) {
+        hash = hash_value(hash);
+        if (ht[hash].sector == sector) {
+            // we have found an open spot
+            if (ht[hash].type != type) {
+                fprintf(stderr, "Incorrect sector type at sector 0x%x! (in ht=%s wanted=%s)\n", sector, names[ht[hash].type], names[type]);
+                abort();
+            }
+            return ht[hash].data;
+        }
+    }
+    // linked list time
+    struct ht_entry *hte = &ht[hash], *next;
+    while (1) {
+        if (hte->sector == sector) {
+            // we have found an open spot
+            if (hte->type != type) {
+                fprintf(stderr, "Incorrect sector type at sector 0x%x! (in ht=%s wanted=%s)\n", sector, names[ht[hash].type], names[type]);
+                exit(-1);
+            }
+            return hte->data;
+        }
+        if (hte->next)
+            hte = hte->next;
+        else {
+            fprintf(stderr, "Invalid sector reference at 0x%x\n", sector);
+            exit(-1);
+        }
+    }
+}
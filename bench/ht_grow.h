@@ -0,0 +1,77 @@
+// The growable open-addressing table that replaced ht_fixed.h in user-003, for htbench.c. It was itself replaced by the
+// node table in user-010.
+
+struct ht_entry {
+    uint32_t sector;
+    int type;
+    void* data;
+};
+
+#define HASHTABLE_INITIAL_ENTRIES (1024)
+static inline uint32_t hash_value(uint32_t key)
+{
+    // Finalizer from MurmurHash3. Sectors tend to be allocated sequentially, so every bit of the key has to matter.
+    key ^= key >> 16;
+    key *= 0x85EBCA6B;
+    key ^= key >> 13;
+    key *= 0xC2B2AE35;
+    key ^= key >> 16;
+    return key;
+}
+static struct ht_entry* ht;
+static uint32_t ht_entries, ht_used;
+static void ht_init(void)
+{
+    ht_entries = HASHTABLE_INITIAL_ENTRIES;
+    ht_used = 0;
+    ht = calloc(ht_entries, sizeof(struct ht_entry));
+}
+
+static void ht_insert(struct ht_entry* table, uint32_t entries, uint32_t sector, int type, void* data)
+{
+    uint32_t mask = entries - 1, hash = hash_value(sector) & mask;
+    while (table[hash].sector != 0) {
+        if (table[hash].sector == sector) {
+            fprintf(stderr, "Sector 0x%x added to hash table twice\n", sector);
+            abort();
+        }
+        hash = (hash + 1) & mask;
+    }
+    table[hash].sector = sector;
+    table[hash].type = type;
+    table[hash].data = data;
+}
+
+static void ht_add(uint32_t sector, int type, void* data)
+{
+    if ((ht_used + 1) * 10 > ht_entries * 7) {
+        // Rehash everything into a table twice the size
+        uint32_t new_entries = ht_entries << 1;
+        struct ht_entry* new_ht = calloc(new_entries, sizeof(struct ht_entry));
+        for (uint32_t i = 0; i < ht_entries; i++)
+            if (ht[i].sector)
+                ht_insert(new_ht, new_entries, ht[i].sector, ht[i].type, ht[i].data);
+        free(ht);
+        ht = new_ht;
+        ht_entries = new_entries;
+    }
+    ht_insert(ht, ht_entries, sector, type, data);
+    ht_used++;
+}
+
+static void* ht_get(uint32_t sector, int type)
+{
+    uint32_t mask = ht_entries - 1, hash = hash_value(sector) & mask;
+    while (ht[hash].sector != sector) {
+        if (ht[hash].sector == 0) {
+            fprintf(stderr, "Invalid sector reference at 0x%x\n", sector);
+            exit(-1);
+        }
+        hash = (hash + 1) & mask;
+    }
+    if (ht[hash].type != type) {
+        fprintf(stderr, "Incorrect sector type at sector 0x%x! (in ht=%s wanted=%s)\n", sector, names[ht[hash].type], names[type]);
+        abort();
+    }
+    return ht[hash].data;
+}
@@ -0,0 +1,66 @@
+// Times ht_get, the LBA lookup that hpfsimg used to find FNODEs and DIRBLKs with before the node table replaced it.
+// Build it with -DFIXED_TABLE for the original table (ht_fixed.h), or without for its replacement (ht_grow.h); see
+// htbench.sh.
+// Usage: htbench <lookups> <entries>...
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+    SECTOR_ENTRY_NONE,
+    SECTOR_ENTRY_DIRBLK,
+    SECTOR_ENTRY_ALSEC,
+    SECTOR_ENTRY_FNODE,
+    SECTOR_ENTRY_DATA
+};
+static const char* names[] = {
+    "none",
+    "dirblk",
+    "alsec",
+    "fnode",
+    "data"
+};
+
+#ifdef FIXED_TABLE
+#include "ht_fixed.h"
+#else
+#include "ht_grow.h"
+#endif
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Sectors handed out the way hpfsimg hands them out: FNODEs one sector apart, mixed in with 4-sector DIRBLKs
+static uint32_t key(uint32_t i)
+{
+    return 20 + i * (i & 1 ? 1 : 4);
+}
+
+int main(int argc, char** argv)
+{
+    static int dummy;
+    static volatile uintptr_t sink; // Keeps the lookups from being optimized away
+    uint32_t lookups = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+    for (int a = 2; a < argc; a++) {
+        uint32_t n = strtoul(argv[a], NULL, 0), x = 1;
+        ht_init();
+        for (uint32_t i = 0; i < n; i++)
+            ht_add(key(i), SECTOR_ENTRY_FNODE, &dummy);
+        uintptr_t sum = 0;
+        double start = now();
+        for (uint32_t k = 0; k < lookups; k++) {
+            x ^= x << 13; // xorshift32, so the lookups don't follow insertion order
+            x ^= x >> 17;
+            x ^= x << 5;
+            sum += (uintptr_t)ht_get(key(x % n), SECTOR_ENTRY_FNODE);
+        }
+        sink = sum;
+        printf("%9u entries: %8.1f ns per lookup\n", n, (now() - start) / lookups * 1e9);
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Make a test tree for bench/uring.sh. "files" is 20000 files of up to 8K in 20 directories (about 80 MB), "large" is
+# three 300 MB files plus 200 small ones. The contents are random; only the sizes matter.
+set -e
+if [ $# -ne 2 ] || [ "$1" != files -a "$1" != large ]; then
+    echo "Usage: $0 files|large <dir>" >&2
+    exit 1
+fi
+mkdir -p "$2"
+if [ "$1" = files ]; then
+    for d in $(seq 0 19); do
+        mkdir -p "$2/dir$d"
+        for f in $(seq 0 999); do
+            head -c $(( (d * 1000 + f) * 2654435761 % 8192 )) /dev/urandom > "$2/dir$d/some_longer_filename_$f.dat"
+        done
+    done
+else
+    for f in 0 1 2; do
+        head -c 300M /dev/urandom > "$2/a$f"
+    done
+    mkdir -p "$2/sub"
+    for f in $(seq 0 199); do
+        head -c $(( f * 97 % 4096 )) /dev/urandom > "$2/sub/s$f.txt"
+    done
+fi
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Time hpfsimg copying a tree onto a fresh 2 GB image with each way of writing it: pread, and io_uring at queue depths
+# 1, 8 and 32. Each time includes the sync at the end, and is the median of 3 runs, in seconds. Put the image on the
+# filesystem you want to measure (e.g. /dev/shm for tmpfs). Build with make.sh first, and run from the top of the
+# repository. bench/mktree.sh makes trees to try it on.
+set -e
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 <tree> <image>" >&2
+    exit 1
+fi
+tree=$1
+img=$2
+# mkhpfs copies the jump and the signature from a boot block, and hpfsimg won't open the image without them
+boot=$(mktemp)
+trap 'rm -f "$boot" "$img"' EXIT
+{ printf '\353\074\220'; head -c 507 /dev/zero; printf '\125\252'; } > "$boot"
+# Prints the median time of 3 copies with the given hpfsimg options
+run() {
+    for n in 1 2 3; do
+        rm -f "$img"
+        ./mkhpfs -b "$boot" -S 2G "$img" > /dev/null 2>&1
+        sync
+        start=$(date +%s.%N)
+        ./hpfsimg -i -d "$tree" "$@" "$img" > /dev/null 2>&1
+        sync
+        end=$(date +%s.%N)
+        echo "$start $end" | awk '{ printf "%.2f\n", $2 - $1 }'
+    done | sort -n | sed -n 2p
+}
+printf "%-6s %s\n" pread "$(run -I pread)"
+for qd in 1 8 32; do
+    printf "%-6s %s\n" QD$qd "$(run -I uring -q $qd)"
+done
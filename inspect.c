@@ -1,4 +1,5 @@
 // Inspects and dumps everything about a HPFS partition
+#define _FILE_OFFSET_BITS 64
 #include <alloca.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,25 +11,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "fs/hpfs/hpfs.h"
-
-static uint32_t partition_offset = 0;
-static void _pread(int fd, void* data, int count, int offset)
-{
-    lseek(fd, offset + partition_offset, SEEK_SET);
-    if (read(fd, data, count) < 0) {
-        perror("read");
-        exit(-1);
-    }
-}
-static void read_sector(int fd, void* data, int sec)
-{
-    _pread(fd, data, 512, sec << 9);
-}
-static void read_sectors(int fd, void* data, int secs, int sec)
-{
-    _pread(fd, data, 512 * secs, sec << 9);
-}
+#include "libhpfs.h"
 
 static void printstr(void* data, int maxchrs)
 {
@@ -54,6 +37,15 @@ static void printtime(uint32_t t)
     printf("%s", asctime(localtime(&tim)));
 }
 
+// libhpfs hands its errors back instead of printing them, and there's nothing to do about one here but give up
+static void volume_check(struct hpfs_volume* vol)
+{
+    if (hpfs_failed(vol)) {
+        fprintf(stderr, "%s\n", vol->error);
+        exit(-1);
+    }
+}
+
 static void pagewait(int paged)
 {
     if (paged) {
@@ -224,7 +216,7 @@ static void handle_dirblk(struct hpfs_dirblk* dirblk, uint32_t blk)
     }
 }
 
-static int printdir(int fd, struct hpfs_fnode* fnode)
+static int printdir(struct hpfs_volume* vol, struct hpfs_fnode* fnode)
 {
     if (!(fnode->dir_flag & HPFS_FNODE_ISDIR)) {
         fprintf(stderr, "Not a directory\n");
@@ -233,30 +225,36 @@ static int printdir(int fd, struct hpfs_fnode* fnode)
     struct hpfs_dirblk dirblk;
     if (fnode->btree_info_flag & HPFS_BTREE_ALNODES)
         for (unsigned int i = 0; i < fnode->used_entries; i++) {
-            read_sectors(fd, &dirblk, 4, fnode->alnodes[i].physical_lba);
+            hpfs_read_sectors(vol, &dirblk, 4, fnode->alnodes[i].physical_lba);
+            volume_check(vol);
             handle_dirblk(&dirblk, fnode->alnodes[i].physical_lba);
         }
     else
         for (unsigned int i = 0; i < fnode->used_entries; i++) {
-            read_sectors(fd, &dirblk, 4, fnode->alleafs[i].physical_lba);
+            hpfs_read_sectors(vol, &dirblk, 4, fnode->alleafs[i].physical_lba);
+            volume_check(vol);
             handle_dirblk(&dirblk, fnode->alleafs[i].physical_lba);
         }
     return 0;
 }
 
-static uint32_t partition_base = 0;
-
 int main(int argc, char** argv)
 {
-    int is_part_image = 0, paged = 0;
+    int is_part_image = 0, paged = 0, io = HPFS_IO_PREAD;
+    uint32_t partition_base = 0;
     char* img = NULL;
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-i")) {
             is_part_image = 1;
         } else if (!strcmp(argv[i], "-p")) {
             paged = 1;
+        } else if (!strcmp(argv[i], "-I")) {
+            if ((io = hpfs_io_lookup(argv[++i])) < 0) {
+                fprintf(stderr, "Unknown I/O backend: %s\n", argv[i]);
+                exit(1);
+            }
         } else if (!strcmp(argv[i], "-o")) {
-            partition_offset = atoi(argv[++i]) * 512;
+            partition_base = strtoul(argv[++i], NULL, 0);
         } else {
             if (argv[i][0] == '-') {
                 fprintf(stderr, "Unknown option: %s\n", argv[i]);
@@ -270,14 +268,13 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    int fd = open(img, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        exit(-1);
-    }
+    struct hpfs_volume* vol = hpfs_volume_open(img, O_RDONLY, io);
+    volume_check(vol);
+    vol->partition_base = partition_base;
 
     struct hpfs_bpb bpb;
-    _pread(fd, &bpb, 512, partition_base);
+    hpfs_pread(vol, &bpb, 512, 0);
+    volume_check(vol);
 
     // Print out stuff about our BPB
     printf(" == BIOS Parameter Block == \n"
@@ -342,7 +339,8 @@ int main(int argc, char** argv)
 
     // Read LBA16
     struct hpfs_superblock superblock;
-    _pread(fd, &superblock, sizeof(struct hpfs_superblock), 16 * secsize);
+    hpfs_pread(vol, &superblock, sizeof(struct hpfs_superblock), 16 * secsize);
+    volume_check(vol);
 
     printf("\n\n == Superblock ==\n");
     printf(
@@ -380,7 +378,8 @@ int main(int argc, char** argv)
     pagewait(paged);
 
     struct hpfs_spareblock spareblock;
-    _pread(fd, &spareblock, sizeof(struct hpfs_spareblock), 17 * secsize);
+    hpfs_pread(vol, &spareblock, sizeof(struct hpfs_spareblock), 17 * secsize);
+    volume_check(vol);
     printf("\n\n == Spareblock ==\n");
     printf(
         "  Signature? %c\n"
@@ -430,7 +429,8 @@ int main(int argc, char** argv)
         fprintf(stderr, "Too many hotfix entries (max total_hotfix_entries: 256)\n");
     else {
         printf("Hotfix list: \n");
-        _pread(fd, hotfix, secsize * 4, secsize * spareblock.hotfix_list);
+        hpfs_pread(vol, hotfix, secsize * 4, (uint64_t)secsize * spareblock.hotfix_list);
+        volume_check(vol);
         if (!spareblock.hotfix_entries_used)
             printf("  (none in use)\n");
         else {
@@ -450,7 +450,8 @@ int main(int argc, char** argv)
         else {
             int bytes = spareblock.spare_dirblks_count << 2;
             uint32_t* dirblks = alloca(bytes);
-            _pread(fd, dirblks, bytes, 17 * secsize + 0x6C);
+            hpfs_pread(vol, dirblks, bytes, 17 * secsize + 0x6C);
+            volume_check(vol);
             printf("Spare dirblk list:");
             unsigned int i = 0;
             while (i < spareblock.spare_dirblks_count) {
@@ -469,13 +470,15 @@ int main(int argc, char** argv)
     if (spareblock.code_page_dir_sec) {
         struct hpfs_codepage_info cpinfo;
         struct hpfs_codepage_data cpdata;
-        read_sector(fd, &cpinfo, spareblock.code_page_dir_sec);
+        hpfs_read_sectors(vol, &cpinfo, 1, spareblock.code_page_dir_sec);
+        volume_check(vol);
         if (cpinfo.signature != HPFS_CODEPAGE_INFO_SIG)
             fprintf(stderr, "Invalid codepage info signature.\n");
         else {
             uint32_t current_sector = spareblock.code_page_dir_sec;
             for (unsigned int i = 0; i < spareblock.total_code_pages;) {
-                read_sector(fd, &cpinfo, current_sector);
+                hpfs_read_sectors(vol, &cpinfo, 1, current_sector);
+                volume_check(vol);
                 if (cpinfo.signature != HPFS_CODEPAGE_INFO_SIG)
                     fprintf(stderr, "Invalid codepage info signature.\n");
                 printf("Codepages:\n"
@@ -493,7 +496,8 @@ int main(int argc, char** argv)
                         cpinfo.entries[j].data_lba,
                         cpinfo.entries[j].dbcs_count);
 
-                    read_sector(fd, &cpdata, cpinfo.entries[j].data_lba);
+                    hpfs_read_sectors(vol, &cpdata, 1, cpinfo.entries[j].data_lba);
+                    volume_check(vol);
                     printf("      Signature? %c\n"
                            "      Number of tables: %d\n"
                            "      Data index: %d\n",
@@ -531,8 +535,10 @@ int main(int argc, char** argv)
     // The housekeeping stuff is now complete. Now we can read the root directory
     printf(" == Root Directory ==\n");
     struct hpfs_fnode fnode;
-    read_sector(fd, &fnode, superblock.rootdir_fnode);
+    hpfs_read_sectors(vol, &fnode, 1, superblock.rootdir_fnode);
+    volume_check(vol);
     validate_fnode(&fnode);
     print_fnode(&fnode);
-    printdir(fd, &fnode);
+    printdir(vol, &fnode);
+    hpfs_volume_close(vol);
 }
\ No newline at end of file
@@ -0,0 +1,911 @@
+// libhpfs - see libhpfs.h
+#define _GNU_SOURCE // for SEEK_DATA
+#define _FILE_OFFSET_BITS 64 // for >4G images on 32-bit hosts
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "libhpfs.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // Linux's UIO_MAXIOV
+#endif
+
+// ============================================================================
+// I/O backends
+// ============================================================================
+
+int hpfs_error(struct hpfs_volume* vol, const char* fmt, ...)
+{
+    // failed is 1 while the message is being written, so that a second error can't write over it, and 2 once it's done
+    int fine = 0;
+    if (__atomic_compare_exchange_n(&vol->failed, &fine, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(vol->error, sizeof(vol->error), fmt, ap);
+        va_end(ap);
+        __atomic_store_n(&vol->failed, 2, __ATOMIC_RELEASE);
+    }
+    return -1;
+}
+
+// Drop the first n bytes from an array of buffers
+static void iov_advance(struct iovec** iov, int* iovcnt, size_t n)
+{
+    while (*iovcnt && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt) {
+        (*iov)->iov_base = (uint8_t*)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+static int pread_read(struct hpfs_volume* vol, void* data, size_t count, uint64_t offset)
+{
+    if (pread(vol->fd, data, count, offset) < 0)
+        return hpfs_error(vol, "read: %s", strerror(errno));
+    return 0;
+}
+// Retries on short writes
+static int pread_writev(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint64_t offset)
+{
+    while (iovcnt) {
+        ssize_t written = pwritev(vol->fd, iov, iovcnt, offset);
+        if (written < 0)
+            return hpfs_error(vol, "pwritev: %s", strerror(errno));
+        offset += written;
+        iov_advance(&iov, &iovcnt, written);
+    }
+    return 0;
+}
+
+// The mmap and memory backends both keep the whole image at vol->image. Returns NULL if the range isn't all in it.
+static void* image_range(struct hpfs_volume* vol, uint64_t offset, size_t count)
+{
+    if (offset + count > vol->image_size) {
+        hpfs_error(vol, "Tried to access past the end of the image (byte %llu)", (unsigned long long)(offset + count));
+        return NULL;
+    }
+    return vol->image + offset;
+}
+// Returns 0 if the image is empty or its size can't be found out
+static uint64_t image_file_size(struct hpfs_volume* vol)
+{
+    struct stat st;
+    if (fstat(vol->fd, &st) < 0) {
+        hpfs_error(vol, "fstat: %s", strerror(errno));
+        return 0;
+    }
+    if (!st.st_size)
+        hpfs_error(vol, "Image is empty, so it can't be held in memory");
+    return st.st_size;
+}
+
+static int mmap_open(struct hpfs_volume* vol)
+{
+    int prot = (fcntl(vol->fd, F_GETFL) & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    if (!(vol->image_size = image_file_size(vol)))
+        return -1;
+    vol->image = mmap(NULL, vol->image_size, prot, MAP_SHARED, vol->fd, 0);
+    if (vol->image == MAP_FAILED) {
+        vol->image = NULL;
+        return hpfs_error(vol, "mmap: %s", strerror(errno));
+    }
+    return 0;
+}
+static void mmap_close(struct hpfs_volume* vol)
+{
+    munmap(vol->image, vol->image_size);
+}
+static int mmap_read(struct hpfs_volume* vol, void* data, size_t count, uint64_t offset)
+{
+    void* src = image_range(vol, offset, count);
+    if (!src)
+        return -1;
+    memcpy(data, src, count);
+    return 0;
+}
+static int mmap_writev(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint64_t offset)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        void* dest = image_range(vol, offset, iov[i].iov_len);
+        if (!dest)
+            return -1;
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// The memory backend only writes back the parts of the image that were written to, a megabyte at a time
+#define DIRTY_CHUNK (1 << 20)
+
+static void memory_mark_dirty(struct hpfs_volume* vol, uint64_t offset, size_t count)
+{
+    for (uint64_t c = offset / DIRTY_CHUNK; c * DIRTY_CHUNK < offset + count; c++)
+        __atomic_store_n(&vol->dirty[c], 1, __ATOMIC_RELAXED);
+}
+// Read [start, end) of the image file into memory
+static int memory_load(struct hpfs_volume* vol, uint64_t start, uint64_t end)
+{
+    while (start < end) {
+        ssize_t got = pread(vol->fd, vol->image + start, end - start < (1 << 30) ? end - start : (1 << 30), start);
+        if (got < 0)
+            return hpfs_error(vol, "read: %s", strerror(errno));
+        if (got == 0)
+            break;
+        start += got;
+    }
+    return 0;
+}
+static int memory_load_all(struct hpfs_volume* vol)
+{
+    // Anonymous memory starts out zeroed, so only the parts of the file that aren't holes have to be read
+#ifdef SEEK_DATA
+    off_t data = 0;
+    while ((data = lseek(vol->fd, data, SEEK_DATA)) >= 0) {
+        off_t hole = lseek(vol->fd, data, SEEK_HOLE);
+        if (memory_load(vol, data, hole))
+            return -1;
+        data = hole;
+    }
+    if (errno != ENXIO) // The filesystem doesn't know about holes
+        return memory_load(vol, 0, vol->image_size);
+    return 0;
+#else
+    return memory_load(vol, 0, vol->image_size);
+#endif
+}
+static int memory_open(struct hpfs_volume* vol)
+{
+    if (!(vol->image_size = image_file_size(vol)))
+        return -1;
+    // Most of a freshly made image is holes that are never touched, so there's no need for the kernel to set aside
+    // enough memory for all of it. If the image really does outgrow memory, the process is killed rather than mmap
+    // failing up front.
+    vol->image = mmap(NULL, vol->image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vol->image == MAP_FAILED) {
+        vol->image = NULL;
+        return hpfs_error(vol, "mmap: %s", strerror(errno));
+    }
+    vol->dirty = calloc((vol->image_size + DIRTY_CHUNK - 1) / DIRTY_CHUNK, 1);
+    if (memory_load_all(vol)) {
+        munmap(vol->image, vol->image_size);
+        free(vol->dirty);
+        vol->image = vol->dirty = NULL;
+        return -1;
+    }
+    return 0;
+}
+static int is_zero(uint8_t* data, size_t count)
+{
+    // If the first byte is zero and every byte equals the one after it, they're all zero
+    return !data[0] && !memcmp(data, data + 1, count - 1);
+}
+static int memory_write_back(struct hpfs_volume* vol, uint64_t start, uint64_t end)
+{
+    struct iovec iov = { vol->image + start, end - start };
+    if (end > start)
+        return pread_writev(vol, &iov, 1, start);
+    return 0;
+}
+// Write back the dirty megabytes, 4K at a time. A page of zeros that would land in a hole is left out, so that the file
+// stays sparse: formatting a big image dirties a megabyte around every band bitmap, and writing them in full would fill
+// in a sixteenth of the image.
+static int memory_sync(struct hpfs_volume* vol)
+{
+    uint64_t chunks = (vol->image_size + DIRTY_CHUNK - 1) / DIRTY_CHUNK, start = 0, end = 0;
+    uint64_t next_data = 0; // Where the file's data starts again, as of the last time we asked
+    for (uint64_t c = 0; c < chunks; c++) {
+        if (!vol->dirty[c])
+            continue;
+        uint64_t chunk_end = (c + 1) * DIRTY_CHUNK < vol->image_size ? (c + 1) * DIRTY_CHUNK : vol->image_size;
+        for (uint64_t page = c * DIRTY_CHUNK; page < chunk_end; page += 4096) {
+            uint64_t page_end = page + 4096 < chunk_end ? page + 4096 : chunk_end;
+            if (is_zero(vol->image + page, page_end - page)) {
+#ifdef SEEK_DATA
+                if (page >= next_data) {
+                    off_t data = lseek(vol->fd, page, SEEK_DATA);
+                    next_data = data >= 0 ? (uint64_t)data : errno == ENXIO ? vol->image_size : page;
+                }
+#endif
+                if (page_end <= next_data)
+                    continue;
+            }
+            if (page != end) {
+                if (memory_write_back(vol, start, end))
+                    return -1;
+                start = page;
+            }
+            end = page_end;
+        }
+        vol->dirty[c] = 0;
+    }
+    return memory_write_back(vol, start, end);
+}
+static void memory_close(struct hpfs_volume* vol)
+{
+    munmap(vol->image, vol->image_size);
+    free(vol->dirty);
+}
+static int memory_writev(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint64_t offset)
+{
+    size_t count = 0;
+    for (int i = 0; i < iovcnt; i++)
+        count += iov[i].iov_len;
+    memory_mark_dirty(vol, offset, count);
+    return mmap_writev(vol, iov, iovcnt, offset);
+}
+
+#ifdef __linux__
+// io_uring, driven directly through the system calls since there's no liburing to lean on. Writes are queued: up to
+// vol->queue_depth of them are in flight at once, each with its own slot holding a copy of its iovec array and the
+// write buffer (if any) to hand back once it's done. Reads wait for everything in flight to finish first, so they always
+// see what was written. The ring is shared between threads, so only one thread can be touching it at a time.
+#define URING_ENTRIES 256
+struct uring_slot {
+    struct iovec* iov; // Points into iov_storage, moving forward after short writes
+    int iovcnt, iov_capacity;
+    struct iovec* iov_storage;
+    uint64_t offset;
+    void* buffer;
+    int busy;
+};
+struct hpfs_uring {
+    int fd;
+    uint32_t *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    struct uring_slot* slots; // vol->queue_depth of them
+    int in_flight;
+    pthread_mutex_t lock;
+};
+
+static void* uring_map(int fd, size_t size, off_t what)
+{
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, what);
+    return p == MAP_FAILED ? NULL : p;
+}
+static void uring_unmap(struct hpfs_uring* r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+static int uring_open(struct hpfs_volume* vol)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) {
+        fprintf(stderr, "io_uring isn't available (%s), using pread/pwrite instead\n", strerror(errno));
+        return -1;
+    }
+    struct hpfs_uring* r = vol->uring = calloc(1, sizeof(struct hpfs_uring));
+    r->fd = fd;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = 0;
+    }
+    if (!(r->sq_ring = uring_map(fd, r->sq_ring_size, IORING_OFF_SQ_RING))
+        || !(r->cq_ring = r->cq_ring_size ? uring_map(fd, r->cq_ring_size, IORING_OFF_CQ_RING) : r->sq_ring)
+        || !(r->sqes = uring_map(fd, r->sqes_size, IORING_OFF_SQES))) {
+        fprintf(stderr, "io_uring's rings can't be mapped (%s), using pread/pwrite instead\n", strerror(errno));
+        uring_unmap(r);
+        free(r);
+        vol->uring = NULL;
+        return -1;
+    }
+    r->sq_tail = (uint32_t*)((uint8_t*)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (uint32_t*)((uint8_t*)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (uint32_t*)((uint8_t*)r->sq_ring + p.sq_off.array);
+    r->cq_head = (uint32_t*)((uint8_t*)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (uint32_t*)((uint8_t*)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (uint32_t*)((uint8_t*)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((uint8_t*)r->cq_ring + p.cq_off.cqes);
+    pthread_mutex_init(&r->lock, NULL);
+    vol->queue_depth = HPFS_DEFAULT_QUEUE_DEPTH;
+    r->slots = calloc(vol->queue_depth, sizeof(struct uring_slot));
+    return 0;
+}
+
+// Hand one SQE to the kernel and get it started. user_data is the slot number, or -1 for a read.
+static int uring_submit(struct hpfs_volume* vol, int op, struct iovec* iov, int iovcnt, uint64_t offset, int64_t user_data)
+{
+    struct hpfs_uring* r = vol->uring;
+    uint32_t tail = *r->sq_tail, idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = vol->fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = iovcnt;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno == EINTR)
+            continue;
+        return hpfs_error(vol, "io_uring_enter: %s", strerror(errno));
+    }
+    return 0;
+}
+static void uring_slot_done(struct hpfs_volume* vol, struct uring_slot* slot)
+{
+    if (slot->buffer)
+        hpfs_put_write_buffer(vol, slot->buffer);
+    slot->busy = 0;
+    vol->uring->in_flight--;
+}
+// Wait for at least one completion (if wait is set) and deal with everything that has completed. Finished writes free
+// up their slots, and short ones are resubmitted for the rest. A failed one is recorded and its slot freed as if it were
+// done. The result of a read is returned in *read_res. Returns -1 if it couldn't wait.
+static int uring_reap(struct hpfs_volume* vol, int wait, int* read_res)
+{
+    struct hpfs_uring* r = vol->uring;
+    uint32_t head = *r->cq_head;
+    while (wait && head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return hpfs_error(vol, "io_uring_enter: %s", strerror(errno));
+    }
+    for (; head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE); head++) {
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        int res = cqe->res;
+        if ((int64_t)cqe->user_data < 0) {
+            *read_res = res;
+            continue;
+        }
+        struct uring_slot* slot = &r->slots[cqe->user_data];
+        if (res <= 0) {
+            size_t left = 0;
+            for (int i = 0; i < slot->iovcnt; i++)
+                left += slot->iov[i].iov_len;
+            hpfs_error(vol, "Write of %zu bytes at byte %llu of the image failed: %s", left,
+                (unsigned long long)slot->offset, res ? strerror(-res) : "nothing was written");
+            uring_slot_done(vol, slot);
+            continue;
+        }
+        slot->offset += res;
+        iov_advance(&slot->iov, &slot->iovcnt, res);
+        if (slot->iovcnt && !uring_submit(vol, IORING_OP_WRITEV, slot->iov, slot->iovcnt, slot->offset, cqe->user_data))
+            continue;
+        uring_slot_done(vol, slot);
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+// Returns -1 if anything has failed on this volume, in flight or otherwise
+static int uring_drain_locked(struct hpfs_volume* vol)
+{
+    while (vol->uring->in_flight)
+        if (uring_reap(vol, 1, NULL))
+            return -1;
+    return hpfs_failed(vol) ? -1 : 0;
+}
+static int uring_drain(struct hpfs_volume* vol)
+{
+    pthread_mutex_lock(&vol->uring->lock);
+    int ret = uring_drain_locked(vol);
+    pthread_mutex_unlock(&vol->uring->lock);
+    return ret;
+}
+static void uring_close(struct hpfs_volume* vol)
+{
+    struct hpfs_uring* r = vol->uring;
+    uring_drain(vol);
+    for (int i = 0; i < vol->queue_depth; i++)
+        free(r->slots[i].iov_storage);
+    free(r->slots);
+    uring_unmap(r);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+static void uring_set_queue_depth(struct hpfs_volume* vol, int depth)
+{
+    struct hpfs_uring* r = vol->uring;
+    pthread_mutex_lock(&r->lock);
+    uring_drain_locked(vol);
+    for (int i = 0; i < vol->queue_depth; i++)
+        free(r->slots[i].iov_storage);
+    free(r->slots);
+    vol->queue_depth = depth < 1 ? 1 : depth > URING_ENTRIES ? URING_ENTRIES : depth;
+    r->slots = calloc(vol->queue_depth, sizeof(struct uring_slot));
+    pthread_mutex_unlock(&r->lock);
+}
+static int uring_read(struct hpfs_volume* vol, void* data, size_t count, uint64_t offset)
+{
+    struct hpfs_uring* r = vol->uring;
+    struct iovec iov = { data, count };
+    int res = INT_MIN;
+    pthread_mutex_lock(&r->lock);
+    if (uring_drain_locked(vol) || uring_submit(vol, IORING_OP_READV, &iov, 1, offset, -1)) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+    while (res == INT_MIN)
+        if (uring_reap(vol, 1, &res)) {
+            // The read is still in flight, and there's no telling when the kernel will be done with data
+            fprintf(stderr, "Can't wait for a read from io_uring: %s\n", vol->error);
+            abort();
+        }
+    pthread_mutex_unlock(&r->lock);
+    if (res < 0)
+        return hpfs_error(vol, "read: %s", strerror(-res));
+    return 0;
+}
+static int uring_submit_writev(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint64_t offset, void* buffer)
+{
+    struct hpfs_uring* r = vol->uring;
+    pthread_mutex_lock(&r->lock);
+    while (r->in_flight == vol->queue_depth)
+        if (uring_reap(vol, 1, NULL)) {
+            pthread_mutex_unlock(&r->lock);
+            return -1;
+        }
+    struct uring_slot* slot = r->slots;
+    while (slot->busy)
+        slot++;
+    if (slot->iov_capacity < iovcnt) {
+        slot->iov_capacity = iovcnt;
+        slot->iov_storage = realloc(slot->iov_storage, iovcnt * sizeof(struct iovec));
+    }
+    memcpy(slot->iov_storage, iov, iovcnt * sizeof(struct iovec));
+    slot->iov = slot->iov_storage;
+    slot->iovcnt = iovcnt;
+    slot->offset = offset;
+    slot->buffer = buffer;
+    slot->busy = 1;
+    r->in_flight++;
+    int ret = uring_submit(vol, IORING_OP_WRITEV, slot->iov, iovcnt, offset, slot - r->slots);
+    if (ret)
+        uring_slot_done(vol, slot);
+    else
+        ret = uring_reap(vol, 0, NULL);
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+static int uring_writev(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint64_t offset)
+{
+    if (uring_submit_writev(vol, iov, iovcnt, offset, NULL))
+        return -1;
+    return uring_drain(vol);
+}
+#else
+static int uring_open(struct hpfs_volume* vol)
+{
+    fprintf(stderr, "io_uring is only available on Linux, using pread/pwrite instead\n");
+    return -1;
+}
+#define uring_close NULL
+#define uring_read NULL
+#define uring_writev NULL
+#define uring_submit_writev NULL
+#define uring_drain NULL
+#define uring_set_queue_depth NULL
+#endif
+
+static const struct hpfs_io_ops io_backends[] = {
+    [HPFS_IO_PREAD] = { "pread", NULL, NULL, pread_read, pread_writev },
+    [HPFS_IO_MMAP] = { "mmap", mmap_open, mmap_close, mmap_read, mmap_writev },
+    [HPFS_IO_URING] = { "uring", uring_open, uring_close, uring_read, uring_writev, uring_submit_writev, uring_drain,
+        uring_set_queue_depth },
+    [HPFS_IO_MEMORY] = { "memory", memory_open, memory_close, mmap_read, memory_writev, NULL, NULL, NULL, memory_sync },
+};
+
+int hpfs_io_lookup(char* name)
+{
+    for (int i = 0; i < (int)(sizeof(io_backends) / sizeof(io_backends[0])); i++)
+        if (!strcmp(name, io_backends[i].name))
+            return i;
+    return -1;
+}
+
+struct hpfs_volume* hpfs_volume_open(char* path, int flags, int io)
+{
+    struct hpfs_volume* vol = calloc(1, sizeof(struct hpfs_volume));
+    pthread_mutex_init(&vol->buffer_lock, NULL);
+    vol->io = &io_backends[HPFS_IO_PREAD];
+    vol->fd = open(path, flags, 0666);
+    if (vol->fd < 0) {
+        hpfs_error(vol, "open: %s", strerror(errno));
+        return vol;
+    }
+    // If the backend can't be opened, pread is used instead. That's also what happens if it failed, so that closing
+    // the volume has nothing of it to undo.
+    if (!io_backends[io].open || !io_backends[io].open(vol))
+        vol->io = &io_backends[io];
+    return vol;
+}
+
+int hpfs_volume_sync(struct hpfs_volume* vol)
+{
+    if (hpfs_drain_writes(vol) || (vol->io->sync && vol->io->sync(vol)))
+        return -1;
+    return hpfs_failed(vol) ? -1 : 0;
+}
+
+int hpfs_volume_close(struct hpfs_volume* vol)
+{
+    int ret = hpfs_volume_sync(vol);
+    if (vol->io->close)
+        vol->io->close(vol);
+    free(vol->blk_bitmaps);
+    free(vol->bitmap_data);
+    free(vol->bitmap_locations);
+    free(vol->dirband_bitmap_data);
+    free(vol->superblock);
+    free(vol->spareblock);
+    free(vol->writes);
+    while (vol->free_buffers) {
+        void* next = *(void**)vol->free_buffers;
+        free(vol->free_buffers);
+        vol->free_buffers = next;
+    }
+    pthread_mutex_destroy(&vol->buffer_lock);
+    if (vol->fd >= 0 && close(vol->fd) < 0)
+        ret = -1;
+    free(vol);
+    return ret;
+}
+
+// ============================================================================
+// Sector I/O
+// ============================================================================
+
+int hpfs_pread(struct hpfs_volume* vol, void* data, size_t count, uint64_t offset)
+{
+    return vol->io->read(vol, data, count, offset + ((uint64_t)vol->partition_base << 9));
+}
+int hpfs_pwrite(struct hpfs_volume* vol, void* data, size_t count, uint64_t offset)
+{
+    struct iovec iov = { data, count };
+    return vol->io->writev(vol, &iov, 1, offset + ((uint64_t)vol->partition_base << 9));
+}
+int hpfs_read_sectors(struct hpfs_volume* vol, void* data, uint32_t secs, uint32_t sec)
+{
+    return hpfs_pread(vol, data, (size_t)secs << 9, (uint64_t)sec << 9);
+}
+int hpfs_write_sectors(struct hpfs_volume* vol, void* data, uint32_t secs, uint32_t sec)
+{
+    return hpfs_pwrite(vol, data, (size_t)secs << 9, (uint64_t)sec << 9);
+}
+int hpfs_writev_sectors(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint32_t sec)
+{
+    return vol->io->writev(vol, iov, iovcnt, (uint64_t)(sec + vol->partition_base) << 9);
+}
+
+void* hpfs_get_write_buffer(struct hpfs_volume* vol)
+{
+    pthread_mutex_lock(&vol->buffer_lock);
+    void* buffer = vol->free_buffers;
+    if (buffer)
+        vol->free_buffers = *(void**)buffer;
+    pthread_mutex_unlock(&vol->buffer_lock);
+    if (!buffer && !(buffer = malloc(HPFS_WRITE_BUFFER_SIZE)))
+        hpfs_error(vol, "Out of memory for write buffers");
+    return buffer;
+}
+void hpfs_put_write_buffer(struct hpfs_volume* vol, void* buffer)
+{
+    pthread_mutex_lock(&vol->buffer_lock);
+    *(void**)buffer = vol->free_buffers;
+    vol->free_buffers = buffer;
+    pthread_mutex_unlock(&vol->buffer_lock);
+}
+int hpfs_submit_write_buffer(struct hpfs_volume* vol, void* buffer, size_t count, uint64_t offset)
+{
+    struct iovec iov = { buffer, count };
+    offset += (uint64_t)vol->partition_base << 9;
+    if (vol->io->submit_writev)
+        return vol->io->submit_writev(vol, &iov, 1, offset, buffer);
+    int ret = vol->io->writev(vol, &iov, 1, offset);
+    hpfs_put_write_buffer(vol, buffer);
+    return ret;
+}
+int hpfs_drain_writes(struct hpfs_volume* vol)
+{
+    if (vol->io->drain)
+        return vol->io->drain(vol);
+    return 0;
+}
+void hpfs_set_queue_depth(struct hpfs_volume* vol, int depth)
+{
+    if (vol->io->set_queue_depth)
+        vol->io->set_queue_depth(vol, depth);
+}
+
+void* hpfs_map_sectors(struct hpfs_volume* vol, uint32_t sec, uint32_t secs)
+{
+    if (!vol->image)
+        return NULL;
+    uint64_t offset = (uint64_t)(sec + vol->partition_base) << 9;
+    if (vol->dirty)
+        memory_mark_dirty(vol, offset, (size_t)secs << 9);
+    return image_range(vol, offset, (size_t)secs << 9);
+}
+
+// ============================================================================
+// Volume structures
+// ============================================================================
+
+int hpfs_find_partition(struct hpfs_volume* vol, int partid)
+{
+    uint8_t mbr[512];
+    vol->partition_base = 0;
+    if (hpfs_read_sectors(vol, mbr, 1, 0))
+        return -1;
+    if (mbr[510] != 0x55 || mbr[511] != 0xAA)
+        return hpfs_error(vol, "No 55AA signature");
+    int pt = 0x1BE;
+    if (partid == -1) {
+        for (int i = 0; i < 4; i++) {
+            if (mbr[pt + 4] == 7) // Use this partition since it's likely HPFS
+                goto done;
+            pt += 0x10;
+        }
+        return hpfs_error(vol, "Unable to find partition with type HPFS. Perhaps manually specify a partition or reformat?");
+    } else {
+        if (partid >= 4 || partid < 0)
+            return hpfs_error(vol, "Partition ID out of bounds");
+        pt += partid << 4;
+    }
+done:
+#define READ32(n) (mbr[n]) | (mbr[n + 1]) << 8 | (mbr[n + 2]) << 16 | (mbr[n + 3]) << 24
+    vol->partition_base = READ32(pt + 8);
+    vol->partition_size = READ32(pt + 12);
+#undef READ32
+    return 0;
+}
+
+int hpfs_read_fixed_blocks(struct hpfs_volume* vol)
+{
+    struct hpfs_bpb bpb;
+    if (hpfs_read_sectors(vol, &bpb, 1, 0))
+        return -1;
+    if (bpb.jmpboot[0] != 0xEB || bpb.boot_magic[0] != 0x55 || bpb.boot_magic[1] != 0xAA || bpb.bytes_per_sector != 512)
+        return hpfs_error(vol, "Invalid BPB fields");
+
+    vol->superblock = calloc(1, 512);
+    if (hpfs_read_sectors(vol, vol->superblock, 1, 16))
+        return -1;
+    if (vol->superblock->signature[0] != HPFS_SUPER_SIG0 || vol->superblock->signature[1] != HPFS_SUPER_SIG1 || vol->superblock->version != 2)
+        return hpfs_error(vol, "Invalid superblock signature");
+
+    vol->spareblock = calloc(1, 512);
+    if (hpfs_read_sectors(vol, vol->spareblock, 1, 17))
+        return -1;
+    if (vol->spareblock->signature[0] != HPFS_SPARE_SIG0 || vol->spareblock->signature[1] != HPFS_SPARE_SIG1)
+        return hpfs_error(vol, "Invalid spareblock signature");
+    return 0;
+}
+
+// Every band bitmap lives in one buffer, in band order, so neighbouring bands' bitmaps are next to each other in memory
+// just like they usually are on disk
+static void alloc_bitmaps(struct hpfs_volume* vol)
+{
+    vol->bitmap_data = malloc((size_t)vol->bands * 2048);
+    vol->blk_bitmaps = malloc(sizeof(uint64_t*) * vol->bands);
+    for (uint32_t i = 0; i < vol->bands; i++)
+        vol->blk_bitmaps[i] = vol->bitmap_data + ((size_t)i << 8);
+}
+
+int hpfs_load_bitmaps(struct hpfs_volume* vol)
+{
+    vol->bands = (vol->superblock->sectors_in_partition + 0x3FFF) >> 14;
+    // The list of bitmap locations takes up 128 bands' worth of entries per sector
+    uint32_t list_sectors = (vol->bands + 127) >> 7;
+    vol->bitmap_locations = malloc(list_sectors * 512);
+    if (hpfs_read_sectors(vol, vol->bitmap_locations, list_sectors, vol->superblock->list_bitmap_secs))
+        return -1;
+    alloc_bitmaps(vol);
+    for (uint32_t i = 0; i < vol->bands; i++)
+        if (hpfs_read_sectors(vol, vol->blk_bitmaps[i], 4, vol->bitmap_locations[i]))
+            return -1;
+    vol->dirband_bitmap_data = malloc(2048);
+    return hpfs_read_sectors(vol, vol->dirband_bitmap_data, 4, vol->superblock->dir_band_bitmap);
+}
+
+void hpfs_create_bitmaps(struct hpfs_volume* vol, uint32_t sectors)
+{
+    vol->bands = (sectors + 0x3FFF) >> 14;
+    // Round the list up to a multiple of four sectors, which is what it gets allocated in
+    vol->bitmap_locations = calloc(((vol->bands + 511) >> 9) << 2, 512);
+    alloc_bitmaps(vol);
+    memset(vol->bitmap_data, 0xFF, (size_t)vol->bands * 2048);
+    vol->dirband_bitmap_data = malloc(2048);
+    memset(vol->dirband_bitmap_data, 0xFF, 2048);
+    vol->lowest_sector_used = vol->dirband_sectors_used = 0;
+}
+
+void hpfs_queue_bitmaps(struct hpfs_volume* vol)
+{
+    hpfs_queue_write(vol, vol->dirband_bitmap_data, 4, vol->superblock->dir_band_bitmap);
+    for (uint32_t i = 0; i < vol->bands; i++) {
+        // An odd band's bitmap is at its end, right before the next band's, so the two usually go out as one write
+        if (i + 1 < vol->bands && vol->bitmap_locations[i] + 4 == vol->bitmap_locations[i + 1]) {
+            hpfs_queue_write(vol, vol->blk_bitmaps[i], 8, vol->bitmap_locations[i]);
+            i++;
+        } else
+            hpfs_queue_write(vol, vol->blk_bitmaps[i], 4, vol->bitmap_locations[i]);
+    }
+}
+
+// ============================================================================
+// Free space bitmaps
+// ============================================================================
+
+uint32_t hpfs_bitmap_find_free(uint64_t** maps, uint32_t sec, uint32_t limit)
+{
+    while (sec < limit) {
+        uint64_t word = HPFS_BITMAP_WORD(maps, sec) >> (sec & 63);
+        if (word) {
+            sec += __builtin_ctzll(word);
+            return sec < limit ? sec : limit;
+        }
+        sec = (sec | 63) + 1;
+    }
+    return limit;
+}
+uint32_t hpfs_bitmap_run_length(uint64_t** maps, uint32_t sec, uint32_t max, uint32_t limit)
+{
+    uint32_t start = sec, end = (limit - sec) < max ? limit : sec + max;
+    while (sec < end) {
+        // Bits shifted in from the top are zero, so they're considered free until we move onto the next word
+        uint64_t word = ~HPFS_BITMAP_WORD(maps, sec) >> (sec & 63);
+        if (word) {
+            sec += __builtin_ctzll(word);
+            break;
+        }
+        sec = (sec | 63) + 1;
+    }
+    return (sec < end ? sec : end) - start;
+}
+void hpfs_bitmap_fill(uint64_t** maps, uint32_t sec, uint32_t count, int set)
+{
+    while (count) {
+        uint32_t bit = sec & 63;
+        if (bit == 0 && count >= 64) {
+            // Whole words: memset until the end of the run or the end of this band, whichever comes first
+            uint32_t words = count >> 6, band_left = (0x4000 - (sec & 0x3FFF)) >> 6;
+            if (words > band_left)
+                words = band_left;
+            memset(&HPFS_BITMAP_WORD(maps, sec), set ? 0xFF : 0, words << 3);
+            sec += words << 6;
+            count -= words << 6;
+            continue;
+        }
+        uint32_t n = 64 - bit < count ? 64 - bit : count;
+        uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << bit;
+        if (set)
+            HPFS_BITMAP_WORD(maps, sec) |= mask;
+        else
+            HPFS_BITMAP_WORD(maps, sec) &= ~mask;
+        sec += n;
+        count -= n;
+    }
+}
+uint32_t hpfs_bitmap_alloc(uint64_t** maps, uint32_t* cursor, uint32_t count, uint32_t limit, uint32_t align)
+{
+    uint32_t sec = *cursor = hpfs_bitmap_find_free(maps, *cursor, limit);
+    while (sec < limit) {
+        sec = (sec + align - 1) & ~(align - 1);
+        if (sec >= limit)
+            break;
+        uint32_t run = hpfs_bitmap_run_length(maps, sec, count, limit);
+        if (run == count) {
+            hpfs_bitmap_fill(maps, sec, count, 0);
+            return sec;
+        }
+        sec = hpfs_bitmap_find_free(maps, sec + run, limit);
+    }
+    return -1;
+}
+
+void hpfs_mark_sectors_used(struct hpfs_volume* vol, uint32_t sec, uint32_t count)
+{
+    hpfs_bitmap_fill(vol->blk_bitmaps, sec, count, 0);
+}
+uint32_t hpfs_alloc_sectors(struct hpfs_volume* vol, uint32_t count, uint32_t align)
+{
+    return hpfs_bitmap_alloc(vol->blk_bitmaps, &vol->lowest_sector_used, count, vol->superblock->sectors_in_partition, align);
+}
+uint32_t hpfs_alloc_dirband_sectors(struct hpfs_volume* vol, uint32_t count)
+{
+    uint32_t retv = hpfs_bitmap_alloc(&vol->dirband_bitmap_data, &vol->dirband_sectors_used, count, vol->superblock->dir_band_sectors, 1);
+    if (retv == (uint32_t)-1)
+        return -1;
+    return retv + vol->superblock->dir_band_start_sec;
+}
+
+// ============================================================================
+// Write-back queue
+// ============================================================================
+
+void hpfs_queue_write(struct hpfs_volume* vol, void* data, uint32_t count, uint32_t sector)
+{
+    if (vol->write_count == vol->write_capacity) {
+        vol->write_capacity = vol->write_capacity ? vol->write_capacity << 1 : 1024;
+        vol->writes = realloc(vol->writes, vol->write_capacity * sizeof(struct hpfs_write));
+    }
+    vol->writes[vol->write_count].sector = sector;
+    vol->writes[vol->write_count].count = count;
+    vol->writes[vol->write_count].data = data;
+    vol->write_count++;
+}
+
+static int write_compare(const void* a, const void* b)
+{
+    uint32_t x = ((const struct hpfs_write*)a)->sector, y = ((const struct hpfs_write*)b)->sector;
+    return x < y ? -1 : x > y;
+}
+
+int hpfs_flush_writes(struct hpfs_volume* vol)
+{
+    int ret = 0;
+    struct iovec iov[IOV_MAX];
+    struct hpfs_write* writes = vol->writes;
+    uint32_t count = vol->write_count;
+    qsort(writes, count, sizeof(struct hpfs_write), write_compare);
+    for (uint32_t i = 0; i < count;) {
+        uint32_t start = writes[i].sector, end = start;
+        int iovcnt = 0;
+        // Keep adding entries for as long as they're directly after the previous one
+        while (i < count && writes[i].sector == end && iovcnt < IOV_MAX) {
+            iov[iovcnt].iov_base = writes[i].data;
+            iov[iovcnt].iov_len = writes[i].count << 9;
+            iovcnt++;
+            end += writes[i].count;
+            i++;
+        }
+        if (i < count && writes[i].sector < end) {
+            fprintf(stderr, "INTERNAL INCONSISTENCY: sector 0x%x is written back twice\n", writes[i].sector);
+            abort();
+        }
+        if (vol->io->submit_writev)
+            ret = vol->io->submit_writev(vol, iov, iovcnt, (uint64_t)(start + vol->partition_base) << 9, NULL);
+        else
+            ret = hpfs_writev_sectors(vol, iov, iovcnt, start);
+        if (ret)
+            break;
+        vol->flushed_runs++;
+        vol->flushed_sectors += end - start;
+    }
+    // Whatever's in flight still points at the caller's buffers, so it has to finish even if something else failed
+    if (hpfs_drain_writes(vol))
+        ret = -1;
+    free(vol->writes);
+    vol->writes = NULL;
+    vol->write_count = vol->write_capacity = 0;
+    return ret;
+}
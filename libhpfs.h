@@ -0,0 +1,168 @@
+// libhpfs - the parts of hpfsimg, mkhpfs and inspect that have to do with the image itself: sector I/O, the free space
+// bitmaps, first-fit allocation, and a queue for writing metadata out in order.
+// Everything hangs off a struct hpfs_volume, so any number of volumes can be open at once. A volume is used by one
+// thread at a time, except that reads and writes of sectors that don't overlap can come from any number of threads.
+// hpfsimg_populate (populate.c) is the same: it can be copying a tree onto any number of volumes at once.
+// Nothing here exits. Functions that can fail return -1 (or NULL), and the first thing that went wrong on a volume is
+// kept in it (see hpfs_error) for the caller to report.
+#ifndef LIBHPFS_H
+#define LIBHPFS_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "fs/hpfs/hpfs.h"
+
+// How the image gets read and written. Every tool can use any of them.
+enum {
+    HPFS_IO_PREAD, // pread/pwrite on the image file
+    HPFS_IO_MMAP, // The image file is mapped (MAP_SHARED), so reads and writes are just copies
+    HPFS_IO_URING, // Reads and writes are submitted through io_uring
+    HPFS_IO_MEMORY // The image is read into memory when it's opened, and what changed is written back when it's closed
+};
+struct hpfs_volume;
+struct hpfs_io_ops {
+    const char* name;
+    // Returns nonzero if the backend can't be used, either because this system doesn't have it (and then something
+    // else is used instead) or because of an error (which is recorded)
+    int (*open)(struct hpfs_volume* vol);
+    void (*close)(struct hpfs_volume* vol);
+    // Offsets here are from the start of the image, not the partition. These return -1 on failure.
+    int (*read)(struct hpfs_volume* vol, void* data, size_t count, uint64_t offset);
+    int (*writev)(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint64_t offset);
+    // Backends that can have writes in flight have these. submit_writev returns as soon as the write is queued; the
+    // iovec array is copied, but the data has to stay put until drain, and buffer (if there is one) is handed back to
+    // hpfs_put_write_buffer once it's been written. A write that fails once it's in flight is reported by drain.
+    int (*submit_writev)(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint64_t offset, void* buffer);
+    int (*drain)(struct hpfs_volume* vol);
+    void (*set_queue_depth)(struct hpfs_volume* vol, int depth);
+    // Backends that hold on to what's written have this, to write it to the image file
+    int (*sync)(struct hpfs_volume* vol);
+};
+
+#define HPFS_DEFAULT_QUEUE_DEPTH 8
+#define HPFS_WRITE_BUFFER_SIZE (1 << 20)
+
+struct hpfs_write {
+    uint32_t sector, count;
+    void* data;
+};
+
+struct hpfs_volume {
+    int fd;
+    const struct hpfs_io_ops* io;
+    uint8_t* image; // The whole image, for the mmap and memory backends
+    uint64_t image_size;
+    uint8_t* dirty; // Memory backend: one byte per megabyte of the image, set once it's been written to
+    struct hpfs_uring* uring;
+    int queue_depth; // How many writes can be in flight at once, or 0 if every write is finished before it returns
+    void* free_buffers; // Write buffers that are ready for reuse, linked through their first word
+    pthread_mutex_t buffer_lock;
+    uint32_t partition_base, partition_size; // In sectors. Every other sector number is relative to partition_base.
+    struct hpfs_superblock* superblock;
+    struct hpfs_spareblock* spareblock;
+
+    // One bitmap per 8 MB band, plus one for the dirband. A set bit means the sector is free.
+    uint32_t bands;
+    uint32_t* bitmap_locations; // Sector of each band's bitmap (the list at superblock->list_bitmap_secs)
+    uint64_t **blk_bitmaps, *dirband_bitmap_data;
+    uint64_t* bitmap_data; // All of the band bitmaps, one after another; blk_bitmaps points into it
+    // First-fit searches start here. Nothing below them is free.
+    uint32_t lowest_sector_used, dirband_sectors_used;
+
+    // Writes queued up by hpfs_queue_write
+    struct hpfs_write* writes;
+    uint32_t write_count, write_capacity;
+    uint32_t flushed_sectors, flushed_runs; // Totals over every hpfs_flush_writes
+
+    // Set once something has gone wrong, after which error says what. Any thread can record an error, so read failed
+    // with hpfs_failed.
+    int failed;
+    char error[256];
+};
+
+// Open the image at path (created if flags has O_CREAT) using backend io. The partition starts at sector 0 until told
+// otherwise. A volume is returned even if the image couldn't be opened, so check hpfs_failed.
+struct hpfs_volume* hpfs_volume_open(char* path, int flags, int io);
+// Write back anything the backend is holding on to and wait for every write in flight
+int hpfs_volume_sync(struct hpfs_volume* vol);
+// hpfs_volume_sync, then close the image and free the volume along with anything loaded into it. Queued writes are
+// dropped. If this fails there's no volume left to say why, so call hpfs_volume_sync first to find out.
+int hpfs_volume_close(struct hpfs_volume* vol);
+// Backend number for a name given on the command line ("pread", "mmap", "uring" or "memory"), or -1
+int hpfs_io_lookup(char* name);
+// Record an error on vol, printf-style, unless there already is one. Returns -1.
+int hpfs_error(struct hpfs_volume* vol, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static inline int hpfs_failed(struct hpfs_volume* vol)
+{
+    return __atomic_load_n(&vol->failed, __ATOMIC_ACQUIRE);
+}
+
+// Reads and writes at a byte offset from the start of the partition
+int hpfs_pread(struct hpfs_volume* vol, void* data, size_t count, uint64_t offset);
+int hpfs_pwrite(struct hpfs_volume* vol, void* data, size_t count, uint64_t offset);
+int hpfs_read_sectors(struct hpfs_volume* vol, void* data, uint32_t secs, uint32_t sec);
+int hpfs_write_sectors(struct hpfs_volume* vol, void* data, uint32_t secs, uint32_t sec);
+// Write a run of buffers to consecutive sectors, starting at sec. iov is used up in the process.
+int hpfs_writev_sectors(struct hpfs_volume* vol, struct iovec* iov, int iovcnt, uint32_t sec);
+// Write buffers hold data that's written asynchronously, when the backend allows it. Fill in one from
+// hpfs_get_write_buffer (HPFS_WRITE_BUFFER_SIZE bytes, or NULL if there's no memory for it) and pass it to
+// hpfs_submit_write_buffer, which writes count bytes of it at a byte offset from the start of the partition and takes
+// care of giving it back afterwards.
+void* hpfs_get_write_buffer(struct hpfs_volume* vol);
+void hpfs_put_write_buffer(struct hpfs_volume* vol, void* buffer);
+int hpfs_submit_write_buffer(struct hpfs_volume* vol, void* buffer, size_t count, uint64_t offset);
+// Wait until every write that's been submitted has finished. Returns -1 if any of them failed.
+int hpfs_drain_writes(struct hpfs_volume* vol);
+// Change how many writes can be in flight at once. Backends that always write synchronously ignore this.
+void hpfs_set_queue_depth(struct hpfs_volume* vol, int depth);
+// If the backend keeps the image in memory, return a pointer to secs sectors starting at sec so that they can be
+// filled in directly, and note that they've been written. Returns NULL for the other backends, or if the sectors are
+// past the end of the image (which is an error).
+void* hpfs_map_sectors(struct hpfs_volume* vol, uint32_t sec, uint32_t secs);
+
+// Find partition partid in the MBR, or the first one with type 7 if it's -1
+int hpfs_find_partition(struct hpfs_volume* vol, int partid);
+// Read and check the boot block, superblock and spareblock
+int hpfs_read_fixed_blocks(struct hpfs_volume* vol);
+// Read every band bitmap and the dirband bitmap. The superblock has to be loaded.
+int hpfs_load_bitmaps(struct hpfs_volume* vol);
+// Set up bitmaps for a brand new volume of the given size, with everything free. bitmap_locations is left for the
+// caller to fill in.
+void hpfs_create_bitmaps(struct hpfs_volume* vol, uint32_t sectors);
+// Queue the band bitmaps and the dirband bitmap for writing
+void hpfs_queue_bitmaps(struct hpfs_volume* vol);
+
+// The bitmaps are scanned a 64-bit word at a time. Each band bitmap covers 0x4000 sectors (256 words), and the dirband
+// bitmap is a single "band" of the same size.
+#define HPFS_BITMAP_WORD(maps, sec) maps[(sec) >> 14][((sec)&0x3FFF) >> 6]
+
+// Find the first free sector at or after sec. Returns limit if there isn't one.
+uint32_t hpfs_bitmap_find_free(uint64_t** maps, uint32_t sec, uint32_t limit);
+// Count the number of contiguous free sectors starting at sec, up to max.
+uint32_t hpfs_bitmap_run_length(uint64_t** maps, uint32_t sec, uint32_t max, uint32_t limit);
+// Mark count sectors starting at sec as free (set != 0) or used (set == 0)
+void hpfs_bitmap_fill(uint64_t** maps, uint32_t sec, uint32_t count, int set);
+// First-fit allocation of count contiguous sectors starting on a multiple of align (a power of two), starting the search
+// at *cursor. Returns -1 if nothing fits.
+uint32_t hpfs_bitmap_alloc(uint64_t** maps, uint32_t* cursor, uint32_t count, uint32_t limit, uint32_t align);
+
+static inline int hpfs_sector_unoccupied(struct hpfs_volume* vol, uint32_t sec)
+{
+    return (HPFS_BITMAP_WORD(vol->blk_bitmaps, sec) >> (sec & 63)) & 1;
+}
+void hpfs_mark_sectors_used(struct hpfs_volume* vol, uint32_t sec, uint32_t count);
+// First-fit allocation from the whole volume. Returns -1 if it's full.
+uint32_t hpfs_alloc_sectors(struct hpfs_volume* vol, uint32_t count, uint32_t align);
+// First-fit allocation from the dirband. Returns -1 if it's full; the caller decides where to go instead.
+uint32_t hpfs_alloc_dirband_sectors(struct hpfs_volume* vol, uint32_t count);
+
+// Rather than writing each structure as soon as it's ready, queue it up: hpfs_flush_writes sorts everything by LBA and
+// writes each run of adjacent sectors with one pwritev (with io_uring, all of the runs are in flight at once). The
+// buffers have to stay around until then.
+void hpfs_queue_write(struct hpfs_volume* vol, void* data, uint32_t count, uint32_t sector);
+int hpfs_flush_writes(struct hpfs_volume* vol);
+
+#endif
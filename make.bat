@@ -1,4 +1,7 @@
 @echo off
-gcc -O2 hpfsimg.c -o hpfs.exe
-gcc -O2 inspect.c -o inspect.exe
-gcc -O2 mkhpfs.c -o mkhpfs.exe
\ No newline at end of file
+gcc -O2 -c libhpfs.c -o libhpfs.o
+ar rcs libhpfs.a libhpfs.o
+gcc -O2 -c populate.c -o populate.o
+gcc -O2 hpfsimg.c populate.o libhpfs.a -o hpfs.exe
+gcc -O2 inspect.c libhpfs.a -o inspect.exe
+gcc -O2 mkhpfs.c populate.o libhpfs.a -o mkhpfs.exe
\ No newline at end of file
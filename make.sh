@@ -1,3 +1,6 @@
-gcc -O2 hpfsimg.c -o hpfsimg
-gcc -O2 inspect.c -o inspect
-gcc -O2 mkhpfs.c -o mkhpfs
\ No newline at end of file
+gcc -O2 -pthread -c libhpfs.c -o libhpfs.o
+ar rcs libhpfs.a libhpfs.o
+gcc -O2 -pthread -c populate.c -o populate.o
+gcc -O2 -pthread hpfsimg.c populate.o libhpfs.a -o hpfsimg
+gcc -O2 -pthread inspect.c libhpfs.a -o inspect
+gcc -O2 -pthread mkhpfs.c populate.o libhpfs.a -o mkhpfs
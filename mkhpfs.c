@@ -1,23 +1,23 @@
 // Format a disk or a partition with HPFS.
+#define _FILE_OFFSET_BITS 64 // off_t has to be 64 bits for disks bigger than 4G
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h> // for time(NULL)
 
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "fs/hpfs/hpfs.h"
+#include "libhpfs.h"
+#include "populate.h"
 
-static uint32_t partition_base, partition_size, cseek;
-static int fd;
-static struct hpfs_superblock* superblock;
-static struct hpfs_spareblock* spareblock;
-static uint32_t **blk_bitmaps, *bitmap_locations, *dirband_bitmap_data;
-static uint32_t dirband_sectors_used;
+static struct hpfs_volume* vol;
 static uint32_t NOW;
 static uint8_t casetbl[256];
 
@@ -37,6 +37,16 @@ struct hpfs_fnode_and_data {
 
 #define BAND_SIZE (8 << 20)
 
+// libhpfs hands its errors back instead of printing them, and there's nothing to do about one here but give up. Writes
+// are only checked every so often, since a failed one is remembered until then.
+static void volume_check(void)
+{
+    if (hpfs_failed(vol)) {
+        fprintf(stderr, "%s\n", vol->error);
+        exit(-1);
+    }
+}
+
 static uint32_t chksum(void* vp, int size)
 {
     uint32_t sum = 0;
@@ -57,8 +67,13 @@ static void help(void)
            "You can specify a partitioned disk (with a MBR) or a raw HPFS partition.\n"
            "args can be:\n"
            " -i  Format raw partition, not disk\n"
-           " -p <id>  Partition number, if raw disk (default: 0)\n"
+           " -S <size>  Create a sparse raw partition image of this size (e.g. 64G) and format it; only the\n"
+           "            filesystem structures themselves are written. Implies -i\n"
+           " -S auto  With -d, make the image the smallest whole number of bands that the directory fits in\n"
+           " -p <id>  Partition number, if partitioned disk (default: first one over 8M)\n"
            " -b <file>  Set boot block image (max size: 8kb)*\n"
+           " -d <dir>  Copy this directory onto the volume once it's formatted (like hpfsimg -d), with the\n"
+           "           directory band and spare dirblks sized for it\n"
            " -h  Show this message\n"
            " -V <str>  Set volume label (default: \"MKHPFS\")\n"
            "\n"
@@ -66,51 +81,210 @@ static void help(void)
            " -H <n>  Set hotfix sector list size (default: 100, max: 255)\n"
            " -s <n>  Set number of spare dirblks (default: 20, max: 100)\n"
            " -O <str>  Set OEM name (default: \"OS2 20.0\")\n"
+           " -D <n>  Size the directory band for n DIRBLKs (plus an eighth), or for the tree in directory n\n"
+           "         (the default with -d; otherwise it's 1%% of the partition)\n"
+           " -R  Put the root FNODE and root DIRBLK right in front of the directory band\n"
+           " -I <io>  I/O backend: pread (default), mmap, uring, or memory\n"
+           " -v  Print how many sectors of each band are used\n"
            "\n"
            "* Note that FAT fields in boot block image will be overwritten\n");
     exit(0);
 }
-static void _pread(int fd, void* data, int count, uint32_t offset)
+// ============================================================================
+// Host tree scan
+// ============================================================================
+// With -d, the tree is walked before anything is laid out, so that the directory band can be made as big as the tree's
+// directories need instead of a fixed fraction of the partition.
+
+struct tree_size {
+    uint32_t dirs, files;
+    uint32_t dirblks; // What the directories will take, packed the way hpfsimg packs them
+    uint32_t alsecs;
+    uint64_t data_bytes, data_sectors;
+};
+
+// How many ALSECs a file of this many sectors needs. On a freshly formatted volume a file breaks where there's a pair of
+// band bitmaps in the way, and around whatever was allocated before it, so allow for one extent per band it passes
+// through, plus one at either end.
+// Past 8 extents, the ALLEAFs go 40 to an ALSEC, with a level of ALNODEs (60 to an ALSEC) for every 12 that don't fit
+// in the FNODE, just like hpfs_build_extent_tree.
+static uint32_t count_alsecs(uint64_t sectors)
 {
-    if (offset != cseek)
-        lseek(fd, offset, SEEK_SET);
-    if (read(fd, data, count) < 0) {
-        perror("read");
-        exit(-1);
+    uint32_t n = sectors / ((BAND_SIZE >> 9) - 4) + 2, total = 0;
+    if (n <= HPFS_ALLEAFS_PER_FNODE)
+        return 0;
+    n = (n + HPFS_ALLEAFS_PER_ALSEC - 1) / HPFS_ALLEAFS_PER_ALSEC;
+    while (1) {
+        total += n;
+        if (n <= HPFS_ALNODES_PER_FNODE)
+            return total;
+        n = (n + HPFS_ALNODES_PER_ALSEC - 1) / HPFS_ALNODES_PER_ALSEC;
     }
-    cseek += count;
-}
-static void read_sector(int fd, void* data, int sec)
-{
-    _pread(fd, data, 512, (sec + partition_base) << 9);
 }
-static void read_sector2(int fd, void* data, int sec)
+
+// How many DIRBLKs a directory with entries of these sizes (in order, ".." first) is going to have. This follows
+// hpfs_pack_dirblks in populate.c: fill each DIRBLK as full as it goes, promote the entry after it to the level above,
+// and repeat until a level fits in one DIRBLK.
+static uint32_t count_dirblks(uint16_t* sizes, int count)
 {
-    _pread(fd, data, 512, sec << 9);
+    uint32_t total = 0;
+    int downlink = 0;
+    while (1) {
+        int capacity = sizeof(struct hpfs_dirblk) - 1 - 0x14 - (32 + downlink), i = 0, npromoted = 0;
+        while (1) {
+            int used = 0;
+            while (i < count && used + sizes[i] + downlink <= capacity)
+                used += sizes[i++] + downlink;
+            if (i == count - 1)
+                i--;
+            total++;
+            if (i >= count)
+                break;
+            sizes[npromoted++] = sizes[i++]; // Never overtakes i, so the level above can go in the same array
+        }
+        if (!npromoted)
+            return total;
+        count = npromoted;
+        downlink = 4;
+    }
 }
-static void read_sectors(int fd, void* data, int secs, int sec)
+
+static int name_compare(const void* a, const void* b)
 {
-    _pread(fd, data, 512 * secs, (sec + partition_base) << 9);
+    return strcasecmp(*(char* const*)a, *(char* const*)b);
 }
-static void _pwrite(int fd, void* data, int count, uint32_t offset)
+
+static void scan_host_dir(char* path, struct tree_size* ts, int is_root)
 {
-    if (offset != cseek)
-        lseek(fd, offset, SEEK_SET);
-    if (write(fd, data, count) < 0) {
-        perror("read");
+    DIR* dir = opendir(path);
+    if (!dir) {
+        perror(path);
         exit(-1);
     }
-    cseek += count;
+    char** names = NULL;
+    int count = 0, capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity << 1 : 64;
+            names = realloc(names, capacity * sizeof(char*));
+        }
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char*), name_compare);
+
+    uint16_t* sizes = malloc((count + 1) * sizeof(uint16_t));
+    int entries = 0;
+    sizes[entries++] = 36; // ".."
+    ts->dirs++;
+    for (int i = 0; i < count; i++) {
+        char* child = malloc(strlen(path) + strlen(names[i]) + 2);
+        struct stat st;
+        sprintf(child, "%s/%s", path, names[i]);
+        if (stat(child, &st) == 0 && (S_ISDIR(st.st_mode) || st.st_size <= UINT32_MAX)) {
+            int namelen = strlen(names[i]) > 254 ? 254 : strlen(names[i]);
+            sizes[entries++] = (0x1F + namelen + 3) & ~3;
+            if (S_ISDIR(st.st_mode))
+                scan_host_dir(child, ts, 0);
+            else {
+                ts->files++;
+                ts->data_bytes += st.st_size;
+                ts->data_sectors += (st.st_size + 511) >> 9;
+                ts->alsecs += count_alsecs((st.st_size + 511) >> 9);
+            }
+        }
+        free(child);
+        free(names[i]);
+    }
+    free(names);
+    // hpfsimg adds the root directory's entries one at a time to the DIRBLK that's already there, and each split leaves
+    // half of a DIRBLK behind, so the root needs up to twice as many
+    ts->dirblks += count_dirblks(sizes, entries) << is_root;
+    free(sizes);
 }
-static void write_sector(int fd, void* data, int sec)
+
+// Determine size of directory band. I couldn't figure out how OS/2 determined this count, but a good approximation is 1% of
+// all sectors. If we know what's going in, though, make room for exactly that plus an eighth, for whatever gets added later.
+static uint32_t dirband_sectors(uint32_t partition_size, uint32_t projected_dirblks)
 {
-    _pwrite(fd, data, 512, (sec + partition_base) << 9);
+    uint32_t dirband_size = partition_size / 100;
+    if (projected_dirblks)
+        dirband_size = (projected_dirblks + projected_dirblks / 8) * 4;
+    dirband_size = (dirband_size + 3) & ~3; // round up to nice even number
+
+    // Cap our dirband size -- don't let it be larger than a band
+    // The dirband bitmap is only four sectors long, indicating that the max size of this structure should be at most 8M.
+    if (dirband_size > 0x3FFC) // 0x4000 - 4 (account for the band bitmap!)
+        dirband_size = 0x3FFC;
+    return dirband_size;
 }
-static void write_sectors(int fd, void* data, int secs, int sec)
+
+// The smallest partition, in whole bands, that holds the tree along with everything main lays out around it, plus a
+// margin. Only the band bitmaps and the list of them depend on the size, so start with one band and add more until it
+// stops growing.
+static uint32_t auto_partition_size(struct tree_size* ts, uint32_t dirband_size, uint32_t hotfixes, uint32_t spares)
 {
-    _pwrite(fd, data, 512 * secs, (sec + partition_base) << 9);
+    uint32_t outside = 0;
+    if (ts->dirblks * 4 > dirband_size) // DIRBLKs that don't fit have to be 4-sector aligned elsewhere
+        outside = (ts->dirblks - dirband_size / 4) * 7;
+    uint64_t fixed = 20 // Boot block, superblock, spareblock
+        + 4 + 4 + hotfixes // Bad sector list, hotfix list, hotfix sectors
+        + 2 // Code pages
+        + 4 + 4 + dirband_size + spares * 4 // Dirband bitmap, root DIRBLK, dirband, spare DIRBLKs
+        + 8 // UID table
+        + (ts->dirs + ts->files) // FNODEs, root included
+        + ts->alsecs + ts->data_sectors + outside;
+    // The ALSEC count is only a guess, and alignment leaves holes that nothing might fill, so leave a little room over.
+    // Running out of space halfway through populating is fatal, so guessing short costs more than a slightly bigger image.
+    fixed += fixed / 256 + 64;
+    uint64_t sectors = BAND_SIZE >> 9;
+    while (1) {
+        uint64_t bands = sectors >> 14, need = fixed + bands * 4 + ((bands * 4 + 2047) / 2048) * 4;
+        if (need <= sectors)
+            return sectors;
+        sectors = (need + 0x3FFF) & ~0x3FFFULL;
+        if (sectors > UINT32_MAX) {
+            fprintf(stderr, "Tree is too big for an HPFS volume\n");
+            exit(1);
+        }
+    }
 }
 
+// Parse a size like 512M or 64G (powers of 1024; a plain number is in bytes)
+static uint64_t parse_size(char* arg)
+{
+    char* end;
+    int shift = 0;
+    errno = 0;
+    uint64_t size = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'T':
+    case 't':
+        shift += 10;
+        // fall through
+    case 'G':
+    case 'g':
+        shift += 10;
+        // fall through
+    case 'M':
+    case 'm':
+        shift += 10;
+        // fall through
+    case 'K':
+    case 'k':
+        shift += 10;
+        end++;
+    }
+    // strtoull quietly negates anything with a minus sign, and saturates instead of failing on overflow
+    if (*end || end == arg || *arg == '-' || errno == ERANGE || size > UINT64_MAX >> shift) {
+        fprintf(stderr, "Invalid size: %s\n", arg);
+        exit(1);
+    }
+    return size << shift;
+}
 static void strcpy2(void* dest, void* src, int len)
 {
     char *srcc = src, *destc = dest;
@@ -135,13 +309,15 @@ static void install_boot_blk(char* img, char* oem, char* vollab)
             exit(1);
         }
         // Read first 512 bytes
-        read_sector2(fd2, &bpb, 0);
+        if (pread(fd2, &bpb, 512, 0) < 0) {
+            perror("read bootblk image");
+            exit(-1);
+        }
     }// else // avoid weird gcc warning
       //  memset(&img, 0, 512);
 
     // Get image size to compute CHS. We only set this for BPB purposes -- all other accesses are done using LBA
-    uint32_t size = lseek(fd, 0, SEEK_END);
-    lseek(fd, cseek, SEEK_SET);
+    uint64_t size = lseek(vol->fd, 0, SEEK_END);
 
     // XXX bad CHS algorithm
     int heads = 16, spt = 63, cyls = (size >> 9) / (heads * spt);
@@ -161,8 +337,8 @@ static void install_boot_blk(char* img, char* oem, char* vollab)
 
     bpb.spt = spt;
     bpb.heads = heads;
-    bpb.hidden_sectors = partition_base;
-    bpb.total_sectors32 = partition_size;
+    bpb.hidden_sectors = vol->partition_base;
+    bpb.total_sectors32 = vol->partition_size;
 
     bpb.drive_number = 0x80;
     bpb.flags = 0;
@@ -174,7 +350,7 @@ static void install_boot_blk(char* img, char* oem, char* vollab)
     bpb.boot_magic[0] = 0x55;
     bpb.boot_magic[1] = 0xAA;
     // Write boot parameter block
-    write_sector(fd, &bpb, 0);
+    hpfs_write_sectors(vol, &bpb, 1, 0);
 
     if (fd2 >= 0) {
         // Now add in the rest of our boot block
@@ -182,7 +358,7 @@ static void install_boot_blk(char* img, char* oem, char* vollab)
         for (int i = 1; i < 16; i++) {
             int retval;
             // read next sector of boot block image
-            if ((retval = read(fd2, sec, 512)) < 0) {
+            if ((retval = pread(fd2, sec, 512, i << 9)) < 0) {
                 perror("read bootblk image");
                 exit(-1);
             }
@@ -190,7 +366,7 @@ static void install_boot_blk(char* img, char* oem, char* vollab)
             if (retval < 512)
                 memset(sec + retval, 0, 512 - retval);
             // Write it to disk
-            write_sector(fd, sec, i);
+            hpfs_write_sectors(vol, sec, 1, i);
 
             // If we've reached the end, then just quit
             if (retval < 512)
@@ -206,9 +382,9 @@ static void populate_superblock(struct hpfs_superblock* superblock)
     superblock->signature[0] = HPFS_SUPER_SIG0;
     superblock->signature[1] = HPFS_SUPER_SIG1;
     superblock->version = 2;
-    superblock->functional_ver = 2; // disk is <= 4G
+    superblock->functional_ver = vol->partition_size > (0x100000000ULL >> 9) ? 3 : 2; // 2 if the disk is <= 4G, 3 if it's bigger
     superblock->rootdir_fnode = 0;
-    superblock->sectors_in_partition = partition_size;
+    superblock->sectors_in_partition = vol->partition_size;
     superblock->bad_sector_count = 0;
     superblock->list_bitmap_secs = 0;
     superblock->bitmap_secs_spare = 0;
@@ -237,62 +413,34 @@ static void populate_spareblock(struct hpfs_spareblock* spareblock, int hotfix2,
     spareblock->total_code_pages = 0;
 }
 
-static int sector_unoccupied(int sec)
+// Band bitmaps go at the start of even bands and at the end of odd ones, so that every odd band's bitmap is directly
+// followed by the next band's. Band 0's would be on top of the boot block, so it's allocated like anything else instead.
+static uint32_t band_bitmap_sector(uint32_t band)
 {
-    uint32_t* bitmap = blk_bitmaps[sec >> 14];
-    int offset = sec & 0x3FFF;
-    return bitmap[offset >> 5] & (1 << (offset & 31));
+    if (!(band & 1))
+        return band << 14;
+    uint32_t sec = ((band + 1) << 14) - 4;
+    // Put it right before the partition end if the band is cut short. I don't know about this behavior
+    return sec < vol->partition_size ? sec : vol->partition_size - 4;
 }
 
-static void mark_sectors_used(int sec, int count)
+static uint32_t alloc_sectors(uint32_t count)
 {
-    if (count == 0)
-        return;
-
-    uint32_t* bitmap = blk_bitmaps[sec >> 14];
-    int offset = sec & 0x3FFF;
-    for (int i = 0; i < count; i++) {
-        // XXX -- there are probably faster ways to do this
-        bitmap[offset >> 5] &= ~(1 << (offset & 31));
-        offset++;
-
-        // If we've reached the end, then move onto the next one
-        if (offset == 0x4000) {
-            bitmap = blk_bitmaps[(sec + offset) >> 14];
-            offset = 0;
-        }
+    uint32_t retv = hpfs_alloc_sectors(vol, count, 1);
+    if (retv == (uint32_t)-1) {
+        fprintf(stderr, "Partition is too small (tried to allocate %d sectors)\n", count);
+        exit(-1);
     }
-}
-static int lowest_sector_used = 0;
-static uint32_t alloc_sectors(int count)
-{
-    // Make sure that our base isn't occupied
-    while (!sector_unoccupied(lowest_sector_used))
-        lowest_sector_used++;
-    int retv = lowest_sector_used;
-    for (int i = 1; i < count; i++)
-        if (!sector_unoccupied(retv + i)) {
-            retv += i;
-            i = 0; // restart from the beginning
-        }
-    mark_sectors_used(retv, count);
     return retv;
 }
 
 // Try to allocate a bunch of sectors from the directory band, but if there's nothing left then allocate from the main band.
 // Strictly speaking, using the dirband is optional, but HPFS would like us to use it.
-static uint32_t alloc_dirband_sectors(int count)
+static uint32_t alloc_dirband_sectors(uint32_t count)
 {
-    if ((dirband_sectors_used + count) >= superblock->dir_band_sectors)
+    uint32_t retv = hpfs_alloc_dirband_sectors(vol, count);
+    if (retv == (uint32_t)-1)
         return alloc_sectors(count);
-
-    int retv = superblock->dir_band_start_sec + dirband_sectors_used;
-    // Mark dirband sectors as used
-    for (int i = 0; i < count; i++) {
-        int ndx = retv + i;
-        dirband_bitmap_data[ndx >> 5] &= ~(1 << (ndx & 31));
-    }
-    dirband_sectors_used += count;
     return retv;
 }
 
@@ -339,8 +487,8 @@ static int create_codepage(void)
 
     // Code pages require a check sum
     data.crc32[0] = info.entries[0].checksum = chksum(&data.entries[0], sizeof(data.entries[0]));
-    write_sector(fd, &data, data_sector);
-    write_sector(fd, &info, info_sector);
+    hpfs_write_sectors(vol, &data, 1, data_sector);
+    hpfs_write_sectors(vol, &info, 1, info_sector);
     return info_sector;
 }
 
@@ -366,6 +514,7 @@ static struct hpfs_fnode* mk_fnode(char* name, uint32_t container_dir_lba, int i
 
     fnode->filelen = isdir ? 0 : length; // Directories have lengths of zero bytes.
     fnode->acl_ea_offset = 0xC4;
+    return fnode;
 }
 
 static int override_dirband = 0;
@@ -434,7 +583,7 @@ static void hpfs_mkdir(struct hpfs_fnode_and_data* fnd, char* name, uint32_t con
 
 static void write_fnode(struct hpfs_fnode_and_data* fnd, int sector)
 {
-    write_sector(fd, fnd->fnode, sector);
+    hpfs_write_sectors(vol, fnd->fnode, 1, sector);
     uint32_t dest_sector;
     switch (fnd->type) {
     case TYPE_DIRECTORY:
@@ -446,14 +595,17 @@ static void write_fnode(struct hpfs_fnode_and_data* fnd, int sector)
         // Fill in dirblk
         ((struct hpfs_dirent*)(&fnd->dirblk->data[0]))->fnode_lba = sector;
 
-        write_sectors(fd, fnd->dirblk, 4, dest_sector);
+        hpfs_write_sectors(vol, fnd->dirblk, 4, dest_sector);
         break;
     }
 }
 
 int main(int argc, char** argv)
 {
-    int raw = 1, partn = -1;
+    int raw_part = 0, partn = -1, io = HPFS_IO_PREAD;
+    uint64_t image_size = 0;
+    int band_stats = 0, spares_given = 0, dirband_near_root = 0, create_image = 0, auto_size = 0;
+    char* projection = NULL;
     char *bootblk = NULL, *system_root = NULL, *img = NULL;
     char *oem = "OS2 20.0", *vollab = "MKHPFS";
     int number_of_hotfix_sectors = 100, number_of_spare_dirblks = 20;
@@ -462,7 +614,7 @@ int main(int argc, char** argv)
             char* arg;
             switch (argv[i][1]) {
             case 'i':
-                raw = 0;
+                raw_part = 1;
                 break;
 #define ARG()                                                   \
     i++;                                                        \
@@ -496,6 +648,15 @@ int main(int argc, char** argv)
                     fprintf(stderr, "Spare dirblk count out of range (%d)\n", number_of_hotfix_sectors);
                     break;
                 }
+                spares_given = 1;
+                break;
+            case 'S':
+                ARG();
+                if (!strcmp(arg, "auto"))
+                    auto_size = 1;
+                else
+                    image_size = parse_size(arg);
+                create_image = raw_part = 1;
                 break;
             case 'O':
                 ARG();
@@ -505,6 +666,23 @@ int main(int argc, char** argv)
                 ARG();
                 vollab = arg;
                 break;
+            case 'I':
+                ARG();
+                if ((io = hpfs_io_lookup(arg)) < 0) {
+                    fprintf(stderr, "Unknown I/O backend: %s\n", arg);
+                    exit(1);
+                }
+                break;
+            case 'v':
+                band_stats = 1;
+                break;
+            case 'D':
+                ARG();
+                projection = arg;
+                break;
+            case 'R':
+                dirband_near_root = 1;
+                break;
             case 'h':
                 help();
                 break;
@@ -520,18 +698,78 @@ int main(int argc, char** argv)
         exit(-1);
     }
 
-    fd = open(img, O_RDWR | O_CREAT, 0666);
-    if (fd < 0) {
-        perror("open");
-        exit(-1);
+    // How many DIRBLKs the volume is expected to hold, from -D or from the tree that -d is going to copy. Without one,
+    // the dirband is sized for the partition instead.
+    uint32_t projected_dirblks = 0;
+    char* scan_root = system_root;
+    if (projection) {
+        struct stat st;
+        char* end;
+        if (stat(projection, &st) == 0 && S_ISDIR(st.st_mode))
+            scan_root = projection;
+        else if ((projected_dirblks = strtoul(projection, &end, 0)) == 0 || *end) {
+            fprintf(stderr, "-D needs a DIRBLK count or a directory: %s\n", projection);
+            exit(1);
+        } else
+            scan_root = NULL;
+    }
+    struct tree_size tree = { 0 };
+    if (scan_root) {
+        scan_host_dir(scan_root, &tree, 1);
+        fprintf(stderr, "%s: %u directories (%u DIRBLKs), %u files, %llu bytes\n", scan_root, tree.dirs, tree.dirblks,
+            tree.files, (unsigned long long)tree.data_bytes);
+        projected_dirblks = tree.dirblks;
     }
+    if (projected_dirblks) {
+        // One spare for every 16 DIRBLKs, so that there's something to fall back on when adding to a full tree
+        if (!spares_given) {
+            number_of_spare_dirblks = projected_dirblks / 16;
+            if (number_of_spare_dirblks < 4)
+                number_of_spare_dirblks = 4;
+            if (number_of_spare_dirblks > 99)
+                number_of_spare_dirblks = 99;
+        }
+    }
+    if (auto_size) {
+        // Make the partition just big enough for the tree, now that we know how much of everything else there is
+        if (!system_root) {
+            fprintf(stderr, "-S auto needs a directory to size the volume for (-d)\n");
+            exit(1);
+        }
+        if (scan_root != system_root) {
+            tree = (struct tree_size){ 0 };
+            scan_host_dir(system_root, &tree, 1);
+        }
+        uint32_t sectors = auto_partition_size(&tree, dirband_sectors(0, projected_dirblks), number_of_hotfix_sectors,
+            number_of_spare_dirblks);
+        fprintf(stderr, "Image size: %u sectors (%u MB) for %llu sectors of data\n", sectors, sectors >> 11,
+            (unsigned long long)tree.data_sectors);
+        image_size = (uint64_t)sectors << 9;
+    }
+
+    if (create_image) {
+        // Whatever was in the image before goes away, and the new one is a hole until something is written to it
+        if (image_size < BAND_SIZE || (image_size >> 9) > UINT32_MAX) {
+            fprintf(stderr, "Image size must be between 8M and 2T\n");
+            exit(1);
+        }
+        int fd = open(img, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0 || ftruncate(fd, image_size & ~511ULL) < 0) {
+            perror("create image");
+            exit(-1);
+        }
+        close(fd);
+    }
+    vol = hpfs_volume_open(img, O_RDWR | O_CREAT, io);
+    volume_check();
 
     NOW = time(NULL);
 
     uint8_t mbr[512];
-    if (raw) {
-        // We can call read_sector to get the MBR since partition_base is still 0.
-        read_sector(fd, mbr, 0);
+    if (!raw_part) {
+        // We can read the MBR as sector 0 since partition_base is still 0.
+        hpfs_read_sectors(vol, mbr, 1, 0);
+        volume_check();
         if (partn == -1) {
             // Find a partition large enough for our purposes
             int base = 0x1BE;
@@ -553,33 +791,29 @@ int main(int argc, char** argv)
         // Set our partion type in the partition table
         if (mbr[0x1BE + (partn * 16) + 4] != 7) {
             mbr[0x1BE + (partn * 16) + 4] = 0x07;
-            write_sector(fd, mbr, 0);
+            hpfs_write_sectors(vol, mbr, 1, 0);
         }
-        partition_base = *(uint32_t*)(&mbr[0x1BE + (partn * 16) + 8]);
-        partition_size = *(uint32_t*)(&mbr[0x1BE + (partn * 16) + 12]);
+        vol->partition_base = *(uint32_t*)(&mbr[0x1BE + (partn * 16) + 8]);
+        vol->partition_size = *(uint32_t*)(&mbr[0x1BE + (partn * 16) + 12]);
     } else {
-        partition_base = 0;
-        partition_size = lseek(fd, 0, SEEK_END);
-        lseek(fd, cseek, SEEK_SET);
+        vol->partition_base = 0;
+        vol->partition_size = lseek(vol->fd, 0, SEEK_END) >> 9;
     }
+    if (vol->partition_size > (64ULL << 30) >> 9)
+        fprintf(stderr, "Warning: partition is larger than 64G, which is the most OS/2 can handle\n");
 
     install_boot_blk(bootblk, oem, vollab);
 
     // Create superblock/spareblock
-    superblock = calloc(1, 512);
-    spareblock = calloc(1, 512);
+    vol->superblock = calloc(1, 512);
+    vol->spareblock = calloc(1, 512);
 
-    populate_superblock(superblock);
-    populate_spareblock(spareblock, number_of_hotfix_sectors, number_of_spare_dirblks);
+    populate_superblock(vol->superblock);
+    populate_spareblock(vol->spareblock, number_of_hotfix_sectors, number_of_spare_dirblks);
 
-    // Determine how many bands we have.
-    int bands = (partition_size + 0x3FFF) >> 14;
-    blk_bitmaps = malloc(bands * sizeof(uint32_t*));
-
-    for (int i = 0; i < bands; i++) {
-        blk_bitmaps[i] = malloc(4 * 512);
-        memset(blk_bitmaps[i], 0xFF, 4 * 512);
-    }
+    // Determine how many bands we have, and start them all off empty
+    hpfs_create_bitmaps(vol, vol->partition_size);
+    int bands = vol->bands;
     // Mark the first 20 sectors as used:
     //  0-15: Bootblock (16)
     //  16: Superblock (1)
@@ -591,18 +825,17 @@ int main(int argc, char** argv)
     int bitmap_sectors = (bands * 4 + 511) / 512;
     bitmap_sectors = (bitmap_sectors + 3) & ~3;
     // Create a list for our band sector usage bitmaps, round up to the first multiple of four
-    int bitmap_list = superblock->list_bitmap_secs = alloc_sectors(bitmap_sectors);
-    bitmap_locations = calloc(bitmap_sectors, 512);
+    int bitmap_list = vol->superblock->list_bitmap_secs = alloc_sectors(bitmap_sectors);
 
     // If Band #0 was a normal band, its bitmap would be located at sector 0.
     // Unfortunately, that's where the boot block is, so we place it as close as possible to the beginning.
-    bitmap_locations[0] = alloc_sectors(4);
+    vol->bitmap_locations[0] = alloc_sectors(4);
 
     // This is four sectors, according to my knowledge
-    superblock->list_bad_secs = alloc_sectors(4);
+    vol->superblock->list_bad_secs = alloc_sectors(4);
 
     // Hotfix entries
-    spareblock->hotfix_list = alloc_sectors(4);
+    vol->spareblock->hotfix_list = alloc_sectors(4);
     int hotfix_sectors = alloc_sectors(number_of_hotfix_sectors);
 
     // We put the hotfix sectors right after hotfix entry table, but first we need to create it
@@ -620,49 +853,22 @@ int main(int argc, char** argv)
     for (int i = 0; i < number_of_hotfix_sectors; i++)
         hotfix_table[i + number_of_hotfix_sectors] = hotfix_sectors + i;
 
+    // Place the rest of the band bitmaps, and mark them (a pair at a time where they're next to each other) as used
+    for (int i = 1; i < bands; i++)
+        vol->bitmap_locations[i] = band_bitmap_sector(i);
     for (int i = 1; i < bands; i++) {
-        // Mark the band bitmaps as being used
-        // Even bitmaps will have them at the beginning, odd bitmaps will have them at the end
-        uint32_t bandid = i * (8 << 20) / 512;
-        const uint32_t BAND_END_M4 = (8 << 20) / 512 - 4;
-        const uint32_t BAND_END = (8 << 20) / 512;
-        if (i & 1) {
-            // end
-            bandid = bandid + BAND_END_M4;
-            int total_sectors = 4;
-            if (bandid >= partition_size) {
-                // Put band right before partition end? I don't know about this behavior
-                bandid = partition_size - 4;
-            }
-#if 0
-            if (bandid >= partition_size) { // We've hit the end of the disk
-                // We have to mark all the sectors after this as unreachable.
-                // For instance, say we have a partition of 125 sectors, and we want to write sector 196. Band 2 ends at sector 200.
-                // That means that (196 + 4) - 125 = 200 - 125 = 75 sectors need to be marked as reserved and used.
-                total_sectors = bandid + 4 - partition_size;
-                // Put the free space bitmap at the end of the disk
-                bandid = partition_size - 4;
-            }
-#endif
-            mark_sectors_used(bandid, total_sectors);
-        } else {
-            int total_sectors = 4;
-#if 0
-            if ((bandid + BAND_END) > partition_size)
-                // Like above: if our band ends at sector 300 but our disk cuts off at 225 (and we're writing sector 200)
-                //  (100 + 200) - 225 = 75
-                total_sectors = bandid + BAND_END_M4 - partition_size;
-#endif
-            mark_sectors_used(bandid, total_sectors);
-        }
-        bitmap_locations[i] = bandid;
+        if (i + 1 < bands && vol->bitmap_locations[i] + 4 == vol->bitmap_locations[i + 1]) {
+            hpfs_mark_sectors_used(vol, vol->bitmap_locations[i], 8);
+            i++;
+        } else
+            hpfs_mark_sectors_used(vol, vol->bitmap_locations[i], 4);
     }
 
     // We handle spare dirblks later; they go in the middle of the disk, if possible.
 
     // Handle code pages. I don't really know how they're supposed to be handled, so I'll only provide the bare minimum implementation here.
-    spareblock->code_page_dir_sec = create_codepage();
-    spareblock->total_code_pages = 1;
+    vol->spareblock->code_page_dir_sec = create_codepage();
+    vol->spareblock->total_code_pages = 1;
 
     // We have to determine where the the directory structures are going to go.
     // Normally, they go in the middle, but if the partition is small enough, they'll be in the beginning
@@ -672,10 +878,12 @@ int main(int argc, char** argv)
     int mid_block = bands >> 1;
     if (mid_block) {
         // If we're jumping to the middle of the disk, find out where to st
-        lowest_sector_used = mid_block * (8 << 20) / 512 - 12;
+        vol->lowest_sector_used = mid_block * (8 << 20) / 512 - (dirband_near_root ? 16 : 12);
     } else {
-        // If we're using block 0, then we start from where we left off.
-        // Nothing to do here
+        // If we're using block 0, then we start from where we left off, rounded up so that the dirband bitmap and the
+        // DIRBLKs after it are on 4-sector boundaries, the same as they are in the middle of a bigger disk
+        uint32_t next_free = hpfs_bitmap_find_free(vol->blk_bitmaps, vol->lowest_sector_used, vol->partition_size);
+        vol->lowest_sector_used = (next_free + 3) & ~3;
     }
     // The layout of the previous block:
     //  +3FF4: directory band bitmap
@@ -687,92 +895,87 @@ int main(int argc, char** argv)
     //  +0A68: Spare Dirblks (your size may vary, default is 0x50)
     //  +0AB8: Root directory FNODE
     //  +0AB9: Band data
+    // With -R, the root FNODE moves in front of the root dirblk instead, and the dirband bitmap four sectors earlier:
+    //  +3FF0: directory band bitmap
+    //  +3FF4: root directory FNODE (the three sectors after it are left alone, so that the dirblk is aligned)
+    //  +3FF8: root directory dirblk
+    // A lookup from the root then reads the FNODE, its dirblk, and the dirband, all within a few sectors of each other.
     int dirband_bitmap_lba = alloc_sectors(4);
-    dirband_bitmap_data = malloc(4 * 512);
-    memset(dirband_bitmap_data, 0xFF, 4 * 512);
+    if (dirband_near_root) {
+        vol->superblock->rootdir_fnode = alloc_sectors(1);
+        vol->lowest_sector_used = (vol->lowest_sector_used + 4) & ~3;
+    }
 
     int rootdir_dirblk_lba = alloc_sectors(4);
     if (mid_block) // We don't have to do this if we're starting from band 0
-        lowest_sector_used += 8; // Skip band bitmaps (3FFC to 0003)
-
-    // Determine size of directory band. I couldn't figure out how OS/2 determined this count, but a good approximation is 1% of all sectors
-    uint32_t dirband_size = partition_size / 100;
-    dirband_size = (dirband_size + 3) & ~3; // round up to nice even number
+        vol->lowest_sector_used += 8; // Skip band bitmaps (3FFC to 0003)
 
-    // Cap our dirband size -- don't let it be larger than a band
-    // The dirband bitmap is only four sectors long, indicating that the max size of this structure should be at most 8M.
-    if (dirband_size > 0x3FFC) // 0x4000 - 4 (account for the band bitmap!)
-        dirband_size = 0x3FFC;
+    uint32_t dirband_size = dirband_sectors(vol->partition_size, projected_dirblks);
     int dirband = alloc_sectors(dirband_size);
 
     // Let the superblock know where our dirband is
-    superblock->dir_band_bitmap = dirband_bitmap_lba;
-    superblock->dir_band_end_sec = dirband + dirband_size - 1; // end is, apparently, inclusive
-    superblock->dir_band_sectors = dirband_size;
-    superblock->dir_band_start_sec = dirband;
-    dirband_sectors_used = 0;
+    vol->superblock->dir_band_bitmap = dirband_bitmap_lba;
+    vol->superblock->dir_band_end_sec = dirband + dirband_size - 1; // end is, apparently, inclusive
+    vol->superblock->dir_band_sectors = dirband_size;
+    vol->superblock->dir_band_start_sec = dirband;
+    vol->dirband_sectors_used = 0;
 
     // Allocate our spare dirblks. Note that each dirblk is 4 sectors, regardless of whether it's a spare or not.
     for (int i = 0; i < number_of_spare_dirblks; i++)
-        spareblock->spare_dirblks[i] = alloc_sectors(4);
+        vol->spareblock->spare_dirblks[i] = alloc_sectors(4);
 
     // Allocate the User ID (ACL) table. Unused
-    superblock->first_uid_sec = alloc_sectors(8);
+    vol->superblock->first_uid_sec = alloc_sectors(8);
 
     // Allocate fnode
-    superblock->rootdir_fnode = alloc_sectors(1);
+    if (!dirband_near_root)
+        vol->superblock->rootdir_fnode = alloc_sectors(1);
+    fprintf(stderr, "Directory band: %u DIRBLKs at 0x%x, root FNODE at 0x%x\n", dirband_size >> 2, dirband,
+        vol->superblock->rootdir_fnode);
     // We're done writing the disk itself -- now it's time for our filesystem.
     // To speed things up, we hold the structure (not the actual contents) in memory, and only write it out when we're completely done with it
     struct hpfs_fnode_and_data rootdir;
     override_dirband = rootdir_dirblk_lba;
-    hpfs_mkdir(&rootdir, "", superblock->rootdir_fnode);
-
-    write_fnode(&rootdir, superblock->rootdir_fnode);
-
-    // Write our housekeeping blocks
-    write_sector(fd, superblock, 16);
-    write_sector(fd, spareblock, 17);
-
-    // Write our hotfix block
-    write_sectors(fd, hotfix_table, 4, spareblock->hotfix_list);
-
-    // Write our indirect blocks list
-    write_sectors(fd, bitmap_locations, bitmap_sectors, bitmap_list);
-
-    // Write dirband bitmap
-    write_sectors(fd, dirband_bitmap_data, 4, dirband_bitmap_lba);
-
-    uint8_t number_of_unfree_sects[256];
-    for (int i = 0; i < 256; i++) {
-        int v = 0;
-        if (!(i & 1))
-            v++;
-        if (!(i & 2))
-            v++;
-        if (!(i & 4))
-            v++;
-        if (!(i & 8))
-            v++;
-        if (!(i & 16))
-            v++;
-        if (!(i & 32))
-            v++;
-        if (!(i & 64))
-            v++;
-        if (!(i & 128))
-            v++;
-        number_of_unfree_sects[i] = v;
+    hpfs_mkdir(&rootdir, "", vol->superblock->rootdir_fnode);
+
+    write_fnode(&rootdir, vol->superblock->rootdir_fnode);
+
+    // Queue up our housekeeping blocks, the hotfix block, our indirect blocks list, and the bitmaps, then write them
+    // all out in LBA order
+    hpfs_queue_write(vol, vol->superblock, 1, 16);
+    hpfs_queue_write(vol, vol->spareblock, 1, 17);
+    hpfs_queue_write(vol, hotfix_table, 4, vol->spareblock->hotfix_list);
+    hpfs_queue_write(vol, vol->bitmap_locations, bitmap_sectors, bitmap_list);
+    // With -d, the bitmaps aren't done until the tree is in, so they're left for hpfsimg_populate to write
+    if (!system_root)
+        hpfs_queue_bitmaps(vol);
+    hpfs_flush_writes(vol);
+    volume_check();
+    if (system_root) {
+        // Start looking for free space from the beginning again, just like a separate hpfsimg run would
+        vol->lowest_sector_used = 0;
+        hpfsimg_populate(vol, system_root, NULL);
+        volume_check();
     }
-    // Write our sectors
+
+    // Without -mpopcnt (which make.sh leaves out, so the tools run on any x86), __builtin_popcountll is libgcc's
+    // bit-twiddling routine rather than a single instruction. That's still plenty fast for 256 words per band.
+    uint32_t total_unfree = 0;
     for (int i = 0; i < bands; i++) {
-        write_sectors(fd, blk_bitmaps[i], 4, bitmap_locations[i]);
-        int unfree = 0;
-        for (int j = 0; j < 2048; j++)
-            unfree += number_of_unfree_sects[((uint8_t*)(blk_bitmaps[i]))[j]];
-        fprintf(stderr, "Band #%d: \n"
-                        " Total sectors: %d\n"
-                        " Sectors used: %d\n"
-                        " Sectors free: %d\n",
-            i, 16 << 10, unfree, (16 << 10) - unfree);
+        int unfree = 16 << 10;
+        for (int j = 0; j < 256; j++)
+            unfree -= __builtin_popcountll(vol->blk_bitmaps[i][j]);
+        total_unfree += unfree;
+        if (band_stats)
+            fprintf(stderr, "Band #%d: \n"
+                            " Total sectors: %d\n"
+                            " Sectors used: %d\n"
+                            " Sectors free: %d\n",
+                i, 16 << 10, unfree, (16 << 10) - unfree);
     }
+    fprintf(stderr, "Formatted %u sectors in %d bands, %u of them used\n", vol->partition_size, bands, total_unfree);
+    free(hotfix_table);
+    hpfs_volume_sync(vol);
+    volume_check();
+    hpfs_volume_close(vol);
 }
\ No newline at end of file
@@ -0,0 +1,3082 @@
+#define _GNU_SOURCE // for copy_file_range
+#define _FILE_OFFSET_BITS 64 // for >4G images on 32-bit hosts
+#include <alloca.h>
+#include <errno.h>
+#include <dirent.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "libhpfs.h"
+#include "populate.h"
+
+static uint8_t casetbl[256];
+static pthread_once_t casetbl_once = PTHREAD_ONCE_INIT;
+
+// ============================================================================
+// Build state
+// ============================================================================
+// Everything one call to hpfsimg_populate works with hangs off a struct build, and what each of its threads keeps to
+// itself off a struct build_thread, so a process can populate any number of volumes at once. The sections below say
+// what their parts of it are for.
+
+// What a node refers to (see "Sector allocation routines")
+enum {
+    SECTOR_ENTRY_NONE,
+    SECTOR_ENTRY_DIRBLK,
+    SECTOR_ENTRY_ALSEC,
+    SECTOR_ENTRY_FNODE,
+    SECTOR_ENTRY_DATA
+};
+
+struct arena_chunk {
+    struct arena_chunk* next;
+    uint8_t data[];
+};
+struct arena {
+    const char* name;
+    uint32_t object_size, used; // "used" is the number of bytes handed out from the current chunk
+    struct arena_chunk* chunks;
+    uint64_t bytes; // Arenas only grow until they're released, so this is also the most they ever held
+};
+
+#define MAX_SIZE_CLASSES 8
+struct size_class_bands {
+    uint32_t* band; // The newest is last
+    uint32_t count, capacity;
+};
+
+struct free_extent;
+struct align_hole;
+struct node;
+struct host_file;
+struct host_listing;
+struct build_worker;
+
+// The main thread has one of these, and so does each builder thread under -t
+struct build_thread {
+    struct build* b;
+    int in_builder; // Set in builder threads, which allocate from region_band (see region_alloc)
+    uint32_t region_band, region_cursor;
+    uint32_t file_align;
+    uint32_t home_band;
+    int size_class; // size_class == size_class_count means large
+    // Extents of the file being copied, which are only turned into a B+tree once they're all known
+    struct hpfs_alleaf* file_extents;
+    uint32_t file_extents_capacity;
+    // Scratch space for adding dirents
+    struct hpfs_dirblk* temp_dirblk;
+    struct hpfs_dirent *temp_dirent, *temp_addfiles_de;
+    // Each thread has its own arenas and statistics, so the hot paths never take build_lock. A builder's are handed to
+    // the main thread once it's done (see build_thread_merge).
+    struct arena sector_arena, dirblk_arena;
+    uint64_t arena_type_bytes[SECTOR_ENTRY_DATA + 1]; // Bytes handed out per metadata type, indexed by SECTOR_ENTRY_*
+    struct {
+        uint64_t distance;
+        uint32_t files;
+    } locality_stats;
+};
+
+struct build {
+    struct hpfs_volume* vol;
+    time_t now;
+    struct build_thread main_thread;
+    pthread_t main_tid;
+    jmp_buf fail_jump; // Where build_fail takes the main thread
+    struct hpfs_fnode* rootdir_fnode;
+    struct hpfs_dirblk* rootdir;
+
+    // Sector allocation routines
+    int build_threads, build_parallel;
+    pthread_mutex_t build_lock_mutex;
+    int alloc_policy;
+    uint32_t data_align, data_align_big;
+    struct free_extent* free_extents[2];
+    uint32_t free_extent_count, treap_seed;
+    uint64_t** shadow_bitmaps;
+    uint32_t shadow_lowest_sector_used;
+    struct {
+        uint32_t files, extents, fragmented, shadow_extents, shadow_fragmented;
+        uint32_t dirblks_outside; // DIRBLKs that didn't go in the dirband
+    } alloc_stats;
+    struct align_hole* align_holes;
+    uint32_t align_hole_count, align_hole_capacity;
+    uint64_t align_padding;
+    uint32_t size_class_limit[MAX_SIZE_CLASSES]; // In sectors
+    struct size_class_bands size_class_bands[MAX_SIZE_CLASSES];
+    int size_class_count;
+    uint32_t size_class_next_band;
+    uint32_t region_next_band;
+    int show_free_frag;
+
+    // Nodes, in chunks of NODE_CHUNK_SIZE that never move once they're allocated
+    struct node** node_chunks;
+    uint32_t node_chunk_count;
+    uint32_t nodes_used; // Node 0 is never handed out, so a zero link is obviously bad
+
+    // Copying file data
+    int copy_file_range_broken;
+    uint64_t bytes_copied;
+
+    // Host tree pipeline
+    int pipeline_threads; // Number of reader threads, 0 if the pipeline is off
+    int plan_layout; // -l: the whole tree is scanned up front (see "Planned layout" below)
+    char* scan_root; // Where the scanner thread starts
+    pthread_mutex_t pipeline_lock;
+    pthread_cond_t pipeline_cond; // Main thread waits on this for listings and data
+    pthread_cond_t reader_cond; // Reader threads wait on this for files and buffer space
+    struct host_listing *listing_head, *listing_tail;
+    struct host_file *prefetch_next, *prefetch_tail;
+    uint64_t prefetch_bytes;
+    int scan_done;
+    struct {
+        uint64_t bytes;
+        uint32_t files;
+    } prefetch_stats;
+    pthread_t* pipeline_tids; // The readers, then the scanner if there is one
+    int pipeline_tid_count;
+
+    // Planned layout
+    uint32_t plan_cursor;
+    struct hpfs_alleaf* plan_extent_list; // Data extents of every planned file, indexed by host_file.plan_extent
+    uint32_t plan_extent_count, plan_extent_capacity;
+    struct host_file** plan_files; // Files with data, in the order they're copied
+    uint32_t plan_file_count;
+    struct host_listing** plan_listings; // Everything we scanned, freed once the data is copied
+    uint32_t plan_listing_count;
+    struct {
+        uint32_t fnodes, split;
+        uint64_t data_sectors;
+    } plan_stats;
+
+    // Placement profile
+    struct host_file* profile_files; // In profile order
+    struct host_file** profile_sorted; // By path, for profile_lookup
+    uint8_t* profile_matched; // Set once profile_lookup has handed out a file's space
+    uint32_t profile_count;
+    char* profile_name; // The -b file
+    int show_profile;
+
+    // Parallel subtree construction
+    struct build_worker* build_workers;
+    uint32_t build_dir_fnode;
+};
+
+static void build_thread_init(struct build_thread* t, struct build* b)
+{
+    memset(t, 0, sizeof(struct build_thread));
+    t->b = b;
+    t->region_band = -1;
+    t->file_align = 1;
+    t->sector_arena = (struct arena) { .name = "512-byte sectors", .object_size = 512 };
+    t->dirblk_arena = (struct arena) { .name = "2048-byte DIRBLKs", .object_size = 2048 };
+}
+static void arena_release(struct arena* a);
+static void build_thread_free(struct build_thread* t)
+{
+    free(t->file_extents);
+    free(t->temp_dirblk);
+    free(t->temp_dirent);
+    free(t->temp_addfiles_de);
+    arena_release(&t->sector_arena);
+    arena_release(&t->dirblk_arena);
+}
+
+// Give up on the build. The error is recorded on the volume, unless fmt is NULL because libhpfs has already done that.
+// The main thread jumps straight back to hpfsimg_populate. Any other thread wakes up everything that might be waiting
+// for it and exits, and the main thread gives up the next time it checks (see build_check). Whatever the thread was in
+// the middle of (an open file, a directory listing) is leaked.
+static void build_fail(struct build* b, const char* fmt, ...)
+{
+    if (fmt) {
+        char error[sizeof(b->vol->error)];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(error, sizeof(error), fmt, ap);
+        va_end(ap);
+        hpfs_error(b->vol, "%s", error);
+    }
+    if (pthread_equal(pthread_self(), b->main_tid))
+        longjmp(b->fail_jump, 1);
+    pthread_mutex_lock(&b->pipeline_lock);
+    pthread_cond_broadcast(&b->pipeline_cond);
+    pthread_cond_broadcast(&b->reader_cond);
+    pthread_mutex_unlock(&b->pipeline_lock);
+    pthread_exit(NULL);
+}
+// Give up if another thread has
+static void build_check(struct build* b)
+{
+    if (hpfs_failed(b->vol))
+        build_fail(b, NULL);
+}
+
+static void print_dirent_name(struct hpfs_dirent* de)
+{
+    if (de->namelen == 2) {
+        if (de->name_stuff[0] == 1 && de->name_stuff[1] == 1) {
+            fprintf(stderr, "/<SPECIAL>/ ..\n");
+            return;
+        }
+    } else if (de->namelen == 1) {
+        if (de->name_stuff[0] == 0xFF) {
+            fprintf(stderr, "/<SPECIAL>/ END\n");
+            return;
+        }
+    }
+    for (unsigned int i = 0; i < de->namelen; i++)
+        fprintf(stderr, "%c", de->name_stuff[i]);
+    fprintf(stderr, "\n");
+}
+static void print_fnode_name(struct hpfs_fnode* fn)
+{
+    unsigned int l = 15;
+    if (fn->namelen < l)
+        l = fn->namelen;
+    for (unsigned int i = 0; i < fn->namelen; i++)
+        fprintf(stderr, "%c", fn->name15[i]);
+    fprintf(stderr, "\n");
+}
+static void print_dirblk(struct hpfs_dirblk* db)
+{
+    int offset = 0x14, id = 0;
+    struct hpfs_dirent* de = (struct hpfs_dirent*)&db->data[0];
+    while (1) {
+        fprintf(stderr, "%d: [at=%d dl=%x] ", id++, offset, *(uint32_t*)(((void*)de) + de->size - 4));
+        print_dirent_name(de);
+        offset += de->size;
+        if (de->size == 0) {
+            abort();
+        }
+        if (de->flags & HPFS_DIRENT_FLAGS_DUMMY_END) {
+            break;
+        }
+        de = ((void*)de) + de->size;
+    }
+    printf("Computed length: %d Actual length: %d\n", offset, db->first_free);
+}
+
+// Sort of like strcmp, but stricter
+// Returns:
+//  0 if the strings are equal
+//  >0 if x comes before y
+//  <0 if y comes before x
+// DO NOT assume anything else about these values but their signs and whether they're zero or not.
+static int fncompare(char* x, int xlen, char* y, int ylen, int casesens)
+{
+    while (1) {
+        if ((xlen | ylen) == 0) // End of both strings, all equal so far
+            return 0;
+        if (!ylen) // end of y
+            return 1;
+        if (!xlen) // end of x
+            return -1;
+        int xc = (uint8_t)*x, yc = (uint8_t)*y, dc;
+        if (casesens) {
+            dc = xc - yc;
+            if (dc == 0) {
+                x++;
+                xlen--;
+                y++;
+                ylen--;
+            } else
+                return dc;
+        } else {
+            dc = casetbl[xc] - casetbl[yc];
+            if (dc == 0) {
+                x++;
+                xlen--;
+                y++;
+                ylen--;
+            } else
+                return dc;
+        }
+    }
+}
+
+// ============================================================================
+// Sector allocation routines
+// ============================================================================
+// While subtrees are being built in parallel (-t), everything shared between the builder threads is protected by
+// build_lock, apart from the node table, which threads append to without it. Outside of that, there's only the main
+// thread and build_lock is never touched.
+static void build_lock(struct build* b)
+{
+    if (b->build_parallel)
+        pthread_mutex_lock(&b->build_lock_mutex);
+}
+static void build_unlock(struct build* b)
+{
+    if (b->build_parallel)
+        pthread_mutex_unlock(&b->build_lock_mutex);
+}
+
+// With -A, file data extents start on a multiple of data_align sectors, or data_align_big for files at least that big.
+// Metadata isn't aligned, and ends up filling some of the holes this leaves.
+static uint32_t data_align_for(struct build* b, uint64_t secs)
+{
+    return b->data_align_big && secs >= b->data_align_big ? b->data_align_big : b->data_align;
+}
+
+// Free extent index. Every maximal run of free sectors is kept in two treaps: one ordered by (length, start) for best-fit
+// lookups, and one ordered by start so that an allocation made through the bitmap can find the run it came out of.
+// It mirrors vol->blk_bitmaps exactly once it's built, so every allocation has to go through extent_index_carve.
+enum {
+    TREE_BY_SIZE,
+    TREE_BY_START
+};
+struct free_extent {
+    uint32_t start, length, prio;
+    struct free_extent* link[2][2]; // [tree][left/right]
+};
+
+static int extent_less(int tree, struct free_extent* x, struct free_extent* y)
+{
+    if (tree == TREE_BY_SIZE && x->length != y->length)
+        return x->length < y->length;
+    return x->start < y->start;
+}
+// Split n into nodes that sort before key (*l) and everything else (*r)
+static void treap_split(int tree, struct free_extent* n, struct free_extent* key, struct free_extent** l, struct free_extent** r)
+{
+    while (n) {
+        if (extent_less(tree, n, key)) {
+            *l = n;
+            l = &n->link[tree][1];
+            n = n->link[tree][1];
+        } else {
+            *r = n;
+            r = &n->link[tree][0];
+            n = n->link[tree][0];
+        }
+    }
+    *l = *r = NULL;
+}
+static struct free_extent* treap_merge(int tree, struct free_extent* l, struct free_extent* r)
+{
+    if (!l || !r)
+        return l ? l : r;
+    if (l->prio > r->prio) {
+        l->link[tree][1] = treap_merge(tree, l->link[tree][1], r);
+        return l;
+    }
+    r->link[tree][0] = treap_merge(tree, l, r->link[tree][0]);
+    return r;
+}
+static void treap_insert(struct build* b, int tree, struct free_extent* node)
+{
+    struct free_extent** p = &b->free_extents[tree];
+    while (*p && (*p)->prio > node->prio)
+        p = &(*p)->link[tree][!extent_less(tree, node, *p)];
+    treap_split(tree, *p, node, &node->link[tree][0], &node->link[tree][1]);
+    *p = node;
+}
+static void treap_remove(struct build* b, int tree, struct free_extent* node)
+{
+    struct free_extent** p = &b->free_extents[tree];
+    while (*p != node)
+        p = &(*p)->link[tree][!extent_less(tree, node, *p)];
+    *p = treap_merge(tree, node->link[tree][0], node->link[tree][1]);
+}
+
+static void extent_index_add(struct build* b, uint32_t start, uint32_t length)
+{
+    struct free_extent* node = malloc(sizeof(struct free_extent));
+    node->start = start;
+    node->length = length;
+    // xorshift32, we only need the priorities to look random
+    b->treap_seed ^= b->treap_seed << 13;
+    b->treap_seed ^= b->treap_seed >> 17;
+    b->treap_seed ^= b->treap_seed << 5;
+    node->prio = b->treap_seed;
+    treap_insert(b, TREE_BY_SIZE, node);
+    treap_insert(b, TREE_BY_START, node);
+    b->free_extent_count++;
+}
+static void extent_index_build(struct build* b)
+{
+    uint32_t limit = b->vol->superblock->sectors_in_partition, sec = 0;
+    while ((sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, sec, limit)) < limit) {
+        uint32_t run = hpfs_bitmap_run_length(b->vol->blk_bitmaps, sec, limit - sec, limit);
+        extent_index_add(b, sec, run);
+        sec += run;
+    }
+}
+static void extent_index_free(struct free_extent* n)
+{
+    if (!n)
+        return;
+    extent_index_free(n->link[TREE_BY_START][0]);
+    extent_index_free(n->link[TREE_BY_START][1]);
+    free(n);
+}
+// Start over from the bitmaps, after they've been changed without going through the index
+static void extent_index_rebuild(struct build* b)
+{
+    extent_index_free(b->free_extents[TREE_BY_START]);
+    b->free_extents[TREE_BY_START] = b->free_extents[TREE_BY_SIZE] = NULL;
+    b->free_extent_count = 0;
+    extent_index_build(b);
+}
+// Smallest free extent that can hold count sectors, or the largest one there is if none can
+static struct free_extent* extent_index_best_fit(struct build* b, uint32_t count)
+{
+    struct free_extent *n = b->free_extents[TREE_BY_SIZE], *best = NULL, *largest = n;
+    while (n) {
+        if (n->length >= count) {
+            best = n;
+            n = n->link[TREE_BY_SIZE][0];
+        } else
+            n = n->link[TREE_BY_SIZE][1];
+    }
+    if (best)
+        return best;
+    while (largest && largest->link[TREE_BY_SIZE][1])
+        largest = largest->link[TREE_BY_SIZE][1];
+    return largest;
+}
+// Remove sectors [sec, sec + count) from the index. They must all be free.
+static void extent_index_carve(struct build* b, uint32_t sec, uint32_t count)
+{
+    if (!b->free_extents[TREE_BY_START] || !count)
+        return;
+    // Find the extent with the largest start <= sec
+    struct free_extent *n = b->free_extents[TREE_BY_START], *node = NULL;
+    while (n) {
+        if (n->start <= sec) {
+            node = n;
+            n = n->link[TREE_BY_START][1];
+        } else
+            n = n->link[TREE_BY_START][0];
+    }
+    if (!node || sec + count > node->start + node->length) {
+        fprintf(stderr, "INTERNAL INCONSISTENCY: sectors 0x%x-0x%x are not in the free extent index\n", sec, sec + count - 1);
+        abort();
+    }
+    uint32_t end = node->start + node->length;
+    treap_remove(b, TREE_BY_SIZE, node);
+    treap_remove(b, TREE_BY_START, node);
+    b->free_extent_count--;
+    if (node->start < sec)
+        extent_index_add(b, node->start, sec - node->start);
+    if (sec + count < end)
+        extent_index_add(b, sec + count, end - (sec + count));
+    free(node);
+}
+
+// To compare allocation policies, we replay every allocation against a copy of the bitmaps using plain first-fit.
+
+// Free sectors left on either side of a data extent because of alignment. They're recorded so that alloc_report can
+// tell how many of them were filled in later.
+struct align_hole {
+    uint32_t sec, count;
+};
+
+static void align_hole_add(struct build* b, uint32_t sec, uint32_t count)
+{
+    if (!count)
+        return;
+    build_lock(b);
+    if (b->align_hole_count == b->align_hole_capacity) {
+        b->align_hole_capacity = b->align_hole_capacity ? b->align_hole_capacity << 1 : 1024;
+        b->align_holes = realloc(b->align_holes, b->align_hole_capacity * sizeof(struct align_hole));
+    }
+    b->align_holes[b->align_hole_count].sec = sec;
+    b->align_holes[b->align_hole_count++].count = count;
+    b->align_padding += count;
+    build_unlock(b);
+}
+// Record the alignment padding around the extent [sec, sec + count): any free sectors right next to it, as long as
+// there are fewer of them than the alignment (otherwise they're just free space).
+static void align_note_padding(struct build_thread* t, uint32_t sec, uint32_t count, uint32_t align)
+{
+    struct build* b = t->b;
+    if (align == 1)
+        return;
+    // A builder thread (see region_alloc) must stay inside its own band
+    uint32_t lo = 0, hi = b->vol->superblock->sectors_in_partition;
+    if (t->in_builder) {
+        lo = t->region_band << 14;
+        hi = lo + 0x4000 < hi ? lo + 0x4000 : hi;
+    }
+    uint32_t before = 0, after = 0, end = sec + count;
+    while (before < align && sec - before > lo && hpfs_sector_unoccupied(b->vol, sec - before - 1))
+        before++;
+    while (after < align && end + after < hi && hpfs_sector_unoccupied(b->vol, end + after))
+        after++;
+    if (before < align)
+        align_hole_add(b, sec - before, before);
+    if (after < align)
+        align_hole_add(b, end, after);
+}
+static void mark_sectors_used(struct build* b, uint32_t sec, uint32_t count)
+{
+    hpfs_mark_sectors_used(b->vol, sec, count);
+    extent_index_carve(b, sec, count);
+}
+
+// Band-affinity allocation (-a band). HPFS splits the volume into 8 MB bands, and the OS/2 driver keeps a directory's
+// files in the band its FNODE is in. We do the same: every directory subtree has a home band, and everything allocated
+// while it's being built (FNODEs, ALSECs, DIRBLKs, and file data) comes from that band, spilling over into the nearest
+// neighbouring bands once it's full. A subdirectory shares its parent's home band until that band is half full, after
+// which it gets the nearest band that isn't.
+
+static uint32_t band_count(struct build* b)
+{
+    return b->vol->bands;
+}
+static uint32_t band_free_sectors(struct build* b, uint32_t band)
+{
+    uint32_t free_secs = 0;
+    for (int i = 0; i < 256; i++)
+        free_secs += __builtin_popcountll(b->vol->blk_bitmaps[band][i]);
+    return free_secs;
+}
+// The i-th band to try, in order of distance from home: home, home + 1, home - 1, home + 2, ... Returns -1 if that one
+// is off the end of the volume.
+static uint32_t band_nearby(struct build* b, uint32_t home, uint32_t i)
+{
+    uint32_t band = i & 1 ? home + (i + 1) / 2 : home - i / 2;
+    return band < band_count(b) ? band : (uint32_t)-1;
+}
+// First-fit within one band: count sectors on a multiple of align, all inside the band. Returns -1 if they don't fit.
+static uint32_t band_first_fit(struct build* b, uint32_t band, uint32_t count, uint32_t align)
+{
+    uint32_t limit = b->vol->superblock->sectors_in_partition;
+    uint32_t end = (band + 1) << 14 < limit ? (band + 1) << 14 : limit;
+    uint32_t sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, band << 14, end);
+    while (sec < end) {
+        sec = (sec + align - 1) & ~(align - 1);
+        if (sec >= end)
+            break;
+        uint32_t run = hpfs_bitmap_run_length(b->vol->blk_bitmaps, sec, count, end);
+        if (run == count) {
+            mark_sectors_used(b, sec, count);
+            return sec;
+        }
+        sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, sec + run, end);
+    }
+    return -1;
+}
+// First-fit within the bands nearest to home_band. The whole run has to fit in one band. Returns -1 if nothing fits
+// anywhere.
+static uint32_t band_alloc(struct build_thread* t, uint32_t count, uint32_t align)
+{
+    struct build* b = t->b;
+    uint32_t bands = band_count(b);
+    for (uint32_t i = 0; i < bands * 2; i++) {
+        uint32_t band = band_nearby(b, t->home_band, i);
+        if (band == (uint32_t)-1)
+            continue;
+        uint32_t sec = band_first_fit(b, band, count, align);
+        if (sec != (uint32_t)-1)
+            return sec;
+    }
+    return -1;
+}
+// Pick the home band for a new subdirectory of a directory with home band 'parent'
+static uint32_t band_pick_home(struct build* b, uint32_t parent)
+{
+    uint32_t bands = band_count(b);
+    for (uint32_t i = 0; i < bands * 2; i++) {
+        uint32_t band = band_nearby(b, parent, i);
+        if (band != (uint32_t)-1 && band_free_sectors(b, band) >= 0x2000)
+            return band;
+    }
+    return parent;
+}
+
+// Size-class segregation (-a size). Files are sorted into classes by size (-c sets the upper bounds). Each small class
+// gets whole bands of its own, claimed from the front of the volume as it needs them, and its files' FNODEs are packed in
+// with their data. A class keeps every band it has claimed until the band is full, so something that doesn't fit in the
+// newest one can still go in a gap in an older one. Files bigger than the last bound are large, and are carved off the
+// end of the highest free run on the volume that can hold them, so they grow downward from the other end. Metadata that
+// isn't a small file's FNODE goes with the smallest class.
+// Band 0 holds the boot block and the superblock, so no class claims it: size_class_next_band starts at 1.
+
+// Parse a comma-separated list of size class bounds in KB
+static void size_class_parse(struct build* b, char* arg)
+{
+    b->size_class_count = 0;
+    for (char* tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        uint32_t secs = strtoul(tok, NULL, 0) * 2;
+        if (b->size_class_count == MAX_SIZE_CLASSES || !secs || secs > 0x2000
+            || (b->size_class_count && secs <= b->size_class_limit[b->size_class_count - 1])) {
+            build_fail(b, "Size classes must be at most %d ascending sizes between 1 and 4096 KB", MAX_SIZE_CLASSES);
+        }
+        b->size_class_limit[b->size_class_count++] = secs;
+    }
+}
+static void size_class_select(struct build_thread* t, uint64_t bytes)
+{
+    struct build* b = t->b;
+    uint64_t secs = (bytes + 511) >> 9;
+    for (t->size_class = 0; t->size_class < b->size_class_count; t->size_class++)
+        if (secs <= b->size_class_limit[t->size_class])
+            break;
+}
+// First-fit within the small size class's bands, newest first. Bands that fill up are dropped from the class, and a new
+// one is claimed when nothing fits in the ones it has.
+static uint32_t size_class_alloc_small(struct build* b, int cls, uint32_t count, uint32_t align)
+{
+    struct size_class_bands* c = &b->size_class_bands[cls];
+    uint32_t bands = band_count(b);
+    for (uint32_t i = c->count; i-- > 0;) {
+        uint32_t sec = band_first_fit(b, c->band[i], count, align);
+        if (sec != (uint32_t)-1)
+            return sec;
+        if (!band_free_sectors(b, c->band[i]))
+            memmove(&c->band[i], &c->band[i + 1], (--c->count - i) * sizeof(uint32_t));
+    }
+    while (b->size_class_next_band < bands) {
+        uint32_t band = b->size_class_next_band++;
+        if (band_free_sectors(b, band) < 0x2000)
+            continue;
+        if (c->count == c->capacity) {
+            c->capacity = c->capacity ? c->capacity << 1 : 16;
+            c->band = realloc(c->band, c->capacity * sizeof(uint32_t));
+        }
+        c->band[c->count++] = band;
+        uint32_t sec = band_first_fit(b, band, count, align);
+        if (sec != (uint32_t)-1)
+            return sec;
+    }
+    return -1;
+}
+// Take count sectors off the end of the highest free run that can hold them, starting on a multiple of align
+static uint32_t size_class_alloc_large(struct build* b, uint32_t count, uint32_t align)
+{
+    uint32_t limit = b->vol->superblock->sectors_in_partition;
+    for (uint32_t band = band_count(b); band-- > 0;) {
+        uint32_t end = (band + 1) << 14 < limit ? (band + 1) << 14 : limit, best = -1;
+        uint32_t sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, band << 14, end);
+        while (sec < end) {
+            uint32_t run = hpfs_bitmap_run_length(b->vol->blk_bitmaps, sec, limit - sec, limit);
+            if (run >= count && ((sec + run - count) & ~(align - 1)) >= sec)
+                best = (sec + run - count) & ~(align - 1);
+            sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, sec + run, end);
+        }
+        if (best != (uint32_t)-1) {
+            mark_sectors_used(b, best, count);
+            return best;
+        }
+    }
+    return -1;
+}
+
+// Parallel subtree construction (-t). Each builder thread claims whole bands for itself and allocates from them with
+// first-fit, so it never touches a bitmap word that another thread could be using. A run can't extend past the end of
+// the band. That's stricter than HPFS itself: only the bitmaps between an odd band and the next even one break up free
+// space, so a normal build can give a file one run across an even band and the odd band after it. Under -t, anything
+// that doesn't fit in what's left of the current band is split at the edge instead, so files of half a band (4 MB) or
+// more end up with more extents than they would otherwise. The free extent index and the shadow bitmaps aren't kept up
+// to date while this goes on; the index is rebuilt afterwards.
+
+static int region_claim(struct build_thread* t)
+{
+    struct build* b = t->b;
+    build_lock(b);
+    uint32_t bands = band_count(b);
+    while (b->region_next_band < bands && !band_free_sectors(b, b->region_next_band))
+        b->region_next_band++;
+    t->region_band = b->region_next_band < bands ? b->region_next_band++ : (uint32_t)-1;
+    build_unlock(b);
+    t->region_cursor = t->region_band << 14;
+    return t->region_band != (uint32_t)-1;
+}
+// Allocate count sectors on a multiple of align from this thread's band. If partial is set, the first free run will do
+// once it's clear the whole thing doesn't fit, which is what big files want. *got is set to the number allocated.
+static uint32_t region_alloc(struct build_thread* t, uint32_t count, uint32_t align, int partial, uint32_t* got)
+{
+    struct build* b = t->b;
+    uint32_t limit = b->vol->superblock->sectors_in_partition;
+    while (1) {
+        if (t->region_band != (uint32_t)-1) {
+            uint32_t end = (t->region_band + 1) << 14 < limit ? (t->region_band + 1) << 14 : limit, first = -1, first_run = 0;
+            uint32_t sec = t->region_cursor = hpfs_bitmap_find_free(b->vol->blk_bitmaps, t->region_cursor, end);
+            while (sec < end) {
+                sec = (sec + align - 1) & ~(align - 1);
+                if (sec >= end)
+                    break;
+                uint32_t run = hpfs_bitmap_run_length(b->vol->blk_bitmaps, sec, count, end);
+                if (run == count || (!first_run && run)) {
+                    first = sec;
+                    first_run = run;
+                    if (run == count)
+                        break;
+                }
+                sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, sec + run, end);
+            }
+            if (first_run == count || (partial && first_run)) {
+                hpfs_bitmap_fill(b->vol->blk_bitmaps, first, first_run, 0);
+                *got = first_run;
+                return first;
+            }
+        }
+        if (!region_claim(t))
+            build_fail(b, "Out of space on volume (tried to allocate %d sectors)", count);
+    }
+}
+
+static uint32_t alloc_sectors_aligned(struct build_thread* t, uint32_t count, uint32_t align)
+{
+    struct build* b = t->b;
+    uint32_t retv = -1;
+    if (t->in_builder)
+        return region_alloc(t, count, align, 0, &retv);
+    if (b->alloc_policy == HPFSIMG_ALLOC_SIZE_CLASS)
+        retv = size_class_alloc_small(b, t->size_class < b->size_class_count ? t->size_class : 0, count, align);
+    else if (b->alloc_policy == HPFSIMG_ALLOC_BAND)
+        retv = band_alloc(t, count, align);
+    if (retv != (uint32_t)-1) {
+        if (b->shadow_bitmaps)
+            hpfs_bitmap_alloc(b->shadow_bitmaps, &b->shadow_lowest_sector_used, count, b->vol->superblock->sectors_in_partition, align);
+        return retv;
+    }
+    retv = hpfs_alloc_sectors(b->vol, count, align);
+    if (retv == (uint32_t)-1)
+        build_fail(b, "Out of space on volume (tried to allocate %d sectors)", count);
+    extent_index_carve(b, retv, count);
+    if (b->shadow_bitmaps)
+        hpfs_bitmap_alloc(b->shadow_bitmaps, &b->shadow_lowest_sector_used, count, b->vol->superblock->sectors_in_partition, align);
+    return retv;
+}
+static uint32_t alloc_sectors(struct build_thread* t, uint32_t count)
+{
+    return alloc_sectors_aligned(t, count, 1);
+}
+// Find the first free run that starts on a multiple of align. Returns its length (up to secs) and stores its start in *sec.
+static uint32_t find_extent(struct build* b, uint32_t secs, uint32_t align, uint32_t* sec)
+{
+    uint32_t limit = b->vol->superblock->sectors_in_partition;
+    uint32_t s = b->vol->lowest_sector_used = hpfs_bitmap_find_free(b->vol->blk_bitmaps, b->vol->lowest_sector_used, limit);
+    while (s < limit) {
+        s = (s + align - 1) & ~(align - 1);
+        if (s >= limit)
+            break;
+        uint32_t run = hpfs_bitmap_run_length(b->vol->blk_bitmaps, s, secs, limit);
+        if (run) {
+            *sec = s;
+            return run;
+        }
+        s = hpfs_bitmap_find_free(b->vol->blk_bitmaps, s, limit);
+    }
+    return 0;
+}
+// Replay a file's data allocation on the shadow bitmaps and return how many extents first-fit would have used
+static uint32_t shadow_first_fit(struct build* b, uint32_t secs)
+{
+    uint32_t limit = b->vol->superblock->sectors_in_partition, extents = 0;
+    while (secs > 0) {
+        uint32_t sec = b->shadow_lowest_sector_used = hpfs_bitmap_find_free(b->shadow_bitmaps, b->shadow_lowest_sector_used, limit);
+        uint32_t x = hpfs_bitmap_run_length(b->shadow_bitmaps, sec, secs, limit);
+        if (x == 0)
+            break; // out of space -- the real allocation will report it
+        hpfs_bitmap_fill(b->shadow_bitmaps, sec, x, 0);
+        secs -= x;
+        extents++;
+    }
+    return extents;
+}
+// Allocate up to count sectors of file data. Returns the first sector and stores the number allocated in *got.
+// Extents start on a multiple of file_align, if there's any free space that allows it.
+static uint32_t alloc_data_sectors(struct build_thread* t, uint32_t count, uint32_t* got)
+{
+    struct build* b = t->b;
+    uint32_t sec = -1, align = t->file_align;
+    if (t->in_builder) {
+        // Anything that fits in half a band is kept in one piece, even if that means moving on to a new band
+        sec = region_alloc(t, count, align, count >= 0x2000, got);
+        align_note_padding(t, sec, *got, align);
+        return sec;
+    }
+    if (b->alloc_policy == HPFSIMG_ALLOC_FIRST_FIT) {
+        if (!(*got = find_extent(b, count, align, &sec)) && !(*got = find_extent(b, count, 1, &sec)))
+            build_fail(b, "Out of space on volume (tried to allocate %d sectors)", count);
+        mark_sectors_used(b, sec, *got);
+        align_note_padding(t, sec, *got, align);
+        return sec;
+    }
+    if (b->alloc_policy == HPFSIMG_ALLOC_BAND)
+        sec = band_alloc(t, count, align);
+    // If nothing near home is big enough, fall through and take the biggest piece there is
+    if (b->alloc_policy == HPFSIMG_ALLOC_SIZE_CLASS)
+        sec = t->size_class < b->size_class_count ? size_class_alloc_small(b, t->size_class, count, align) : size_class_alloc_large(b, count, align);
+    if (sec != (uint32_t)-1)
+        *got = count;
+    else {
+        // Best-fit: asking for align - 1 more sectors than we need makes sure the aligned start still fits
+        struct free_extent* ext = extent_index_best_fit(b, count + align - 1);
+        if (!ext)
+            build_fail(b, "Out of space on volume (tried to allocate %d sectors)", count);
+        uint32_t end = ext->start + ext->length;
+        sec = (ext->start + align - 1) & ~(align - 1);
+        if (sec >= end) // Not even one aligned sector in the biggest free run, so give up on alignment
+            sec = ext->start;
+        *got = end - sec < count ? end - sec : count;
+        mark_sectors_used(b, sec, *got);
+    }
+    align_note_padding(t, sec, *got, align);
+    return sec;
+}
+
+static void alloc_init(struct build* b)
+{
+    if (b->alloc_policy == HPFSIMG_ALLOC_FIRST_FIT)
+        return;
+    extent_index_build(b);
+    if (b->build_threads)
+        return; // Builder threads can't replay anything in order
+    b->shadow_bitmaps = malloc(sizeof(uint64_t*) * b->vol->bands);
+    for (unsigned int i = 0; i < b->vol->bands; i++) {
+        b->shadow_bitmaps[i] = malloc(2048);
+        memcpy(b->shadow_bitmaps[i], b->vol->blk_bitmaps[i], 2048);
+    }
+}
+
+// How far file data ends up from the directory that lists it: the distance between a directory's top DIRBLK and the first
+// sector of each of its files, averaged over every file with data.
+
+static void locality_add(struct build_thread* t, uint32_t dirblk_sec, uint32_t data_sec)
+{
+    t->locality_stats.distance += dirblk_sec > data_sec ? dirblk_sec - data_sec : data_sec - dirblk_sec;
+    t->locality_stats.files++;
+}
+
+// Histogram of free runs, in the same format as fst's "info" output. A free run can't span more than two bands, so
+// nothing is longer than 32767 sectors.
+static void free_frag_report(struct build* b)
+{
+    uint32_t limit = b->vol->superblock->sectors_in_partition, counts[15] = { 0 };
+    for (uint32_t sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, 0, limit); sec < limit;) {
+        uint32_t run = hpfs_bitmap_run_length(b->vol->blk_bitmaps, sec, limit - sec, limit);
+        if (run < 32768)
+            counts[31 - __builtin_clz(run)]++;
+        sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, sec + run, limit);
+    }
+    fprintf(stderr, "\nFragmentation of free space:\n");
+    fprintf(stderr, "Fragment size | Number of fragments of that size\n");
+    fprintf(stderr, "--------------+---------------------------------\n");
+    for (int i = 0; i < 15; i++)
+        fprintf(stderr, " %5u-%-5u  | %u\n", 1 << i, (2 << i) - 1, counts[i]);
+    fprintf(stderr, "\n");
+}
+
+static void alloc_report(struct build* b)
+{
+    static const char* policy_names[] = { "best-fit", "first-fit", "band", "size classes" };
+    fprintf(stderr, "Allocation report (%s):\n"
+                    "  Files with data: %d\n"
+                    "  Data extents: %d\n"
+                    "  Files with more than one extent: %d\n",
+        policy_names[b->alloc_policy],
+        b->alloc_stats.files, b->alloc_stats.extents, b->alloc_stats.fragmented);
+    if (b->main_thread.locality_stats.files) {
+        uint64_t avg = b->main_thread.locality_stats.distance / b->main_thread.locality_stats.files;
+        fprintf(stderr, "  Average distance from DIRBLK to file data: %llu sectors (%llu KB)\n",
+            (unsigned long long)avg, (unsigned long long)avg >> 1);
+    }
+    if (b->data_align > 1 || b->data_align_big) {
+        uint64_t filled = 0;
+        for (uint32_t i = 0; i < b->align_hole_count; i++)
+            for (uint32_t j = 0; j < b->align_holes[i].count; j++)
+                filled += !hpfs_sector_unoccupied(b->vol, b->align_holes[i].sec + j);
+        fprintf(stderr, "  Alignment padding (%u", b->data_align);
+        if (b->data_align_big)
+            fprintf(stderr, ", %u for big files", b->data_align_big);
+        fprintf(stderr, "): %llu sectors, %llu of them filled in later, %llu KB left unused\n",
+            (unsigned long long)b->align_padding, (unsigned long long)filled, (unsigned long long)(b->align_padding - filled) >> 1);
+    }
+    if (b->shadow_bitmaps)
+        fprintf(stderr, "  Data extents with first-fit: %d\n"
+                        "  Files with more than one extent with first-fit: %d\n"
+                        "  Free extents remaining: %d\n",
+            b->alloc_stats.shadow_extents, b->alloc_stats.shadow_fragmented, b->free_extent_count);
+
+    // How much of the dirband is in use, counting what was there before we started
+    uint32_t dirband_free = 0, dirband_secs = b->vol->superblock->dir_band_sectors;
+    for (uint32_t i = 0; i < dirband_secs; i++)
+        dirband_free += (b->vol->dirband_bitmap_data[i >> 6] >> (i & 63)) & 1;
+    fprintf(stderr, "  Directory band: %u of %u DIRBLKs used (%u%%), %u DIRBLKs outside of it\n",
+        (dirband_secs - dirband_free) >> 2, dirband_secs >> 2,
+        dirband_secs ? (uint32_t)((uint64_t)(dirband_secs - dirband_free) * 100 / dirband_secs) : 0,
+        b->alloc_stats.dirblks_outside);
+}
+
+// Try to allocate a bunch of sectors from the directory band, but if there's nothing left then allocate from the main band.
+// Strictly speaking, using the dirband is optional, but HPFS would like us to use it.
+static uint32_t alloc_dirband_sectors(struct build_thread* t, uint32_t count)
+{
+    struct build* b = t->b;
+    build_lock(b);
+    uint32_t retv = b->alloc_policy == HPFSIMG_ALLOC_BAND ? (uint32_t)-1 : hpfs_alloc_dirband_sectors(b->vol, count);
+    if (retv == (uint32_t)-1)
+        b->alloc_stats.dirblks_outside++;
+    build_unlock(b);
+    if (b->alloc_policy == HPFSIMG_ALLOC_BAND)
+        return alloc_sectors_aligned(t, count, 4); // Keep DIRBLKs in the home band with the rest of the directory
+    if (retv == (uint32_t)-1)
+        return alloc_sectors_aligned(t, count, 4); // DIRBLKs outside of the dirband still have to be 4-sector aligned
+
+    fprintf(stderr, " > alloc: %x\n", retv);
+    return retv;
+}
+
+// Every FNODE, ALSEC, and DIRBLK we create gets a node, which is how we find them all again at writeback time.
+// Links inside the DIRBLK and ALSEC B-trees (this_lba, parent_lba, downlinks, and ALNODE pointers, along with a directory
+// FNODE's pointer to its top DIRBLK and a FNODE's ALNODE pointers) hold node numbers rather than LBAs while we're building,
+// so following one is an array index instead of a lookup. The fields are only 32 bits wide, which is why these are
+// indexes and not real pointers. nodes_serialize turns them all back into LBAs right before writeback.
+// The exceptions are links to a FNODE (the parent of a top DIRBLK or of an ALSEC with HPFS_BTREE_PARENT_IS_FNODE), which
+// are always LBAs.
+static const char* names[] = {
+    "none",
+    "dirblk",
+    "alsec",
+    "fnode",
+    "data"
+};
+
+struct node {
+    uint32_t sector;
+    int type;
+    void* data;
+};
+
+// The table is a list of chunks, allocated as they're needed. Every node has a sector of its own, so there's never more
+// of them than the volume has sectors, which is what node_init sizes the list for.
+#define NODE_CHUNK_SHIFT 14
+#define NODE_CHUNK_SIZE (1 << NODE_CHUNK_SHIFT)
+
+static void node_init(struct build* b)
+{
+    b->node_chunk_count = (b->vol->superblock->sectors_in_partition >> NODE_CHUNK_SHIFT) + 1;
+    b->node_chunks = calloc(b->node_chunk_count, sizeof(struct node*));
+    b->nodes_used = 1;
+}
+
+static inline struct node* node_at(struct build* b, uint32_t n)
+{
+    return &b->node_chunks[n >> NODE_CHUNK_SHIFT][n & (NODE_CHUNK_SIZE - 1)];
+}
+
+// Builder threads each claim a node number and fill it in without a lock. If the number starts a chunk that nobody has
+// allocated yet, whoever gets there first allocates it; chunks never move, so nodes can be read while others are added.
+static uint32_t node_add(struct build* b, uint32_t sector, int type, void* data)
+{
+    uint32_t n = __atomic_fetch_add(&b->nodes_used, 1, __ATOMIC_RELAXED);
+    if ((n >> NODE_CHUNK_SHIFT) >= b->node_chunk_count) {
+        fprintf(stderr, "More nodes than sectors (likely a bug)\n");
+        abort();
+    }
+    struct node** slot = &b->node_chunks[n >> NODE_CHUNK_SHIFT];
+    struct node* chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!chunk) {
+        struct node* fresh = malloc(NODE_CHUNK_SIZE * sizeof(struct node));
+        if (__atomic_compare_exchange_n(slot, &chunk, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            chunk = fresh;
+        else
+            free(fresh);
+    }
+    chunk[n & (NODE_CHUNK_SIZE - 1)] = (struct node) { .sector = sector, .type = type, .data = data };
+    return n;
+}
+
+// Builder threads only ever look up their own nodes
+static void* node_get(struct build* b, uint32_t n, int type)
+{
+    if (n == 0 || n >= __atomic_load_n(&b->nodes_used, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Invalid node reference %u\n", n);
+        abort();
+    }
+    struct node* node = node_at(b, n);
+    if (node->type != type) {
+        fprintf(stderr, "Incorrect node type at sector 0x%x! (node=%s wanted=%s)\n", node->sector, names[node->type], names[type]);
+        abort();
+    }
+    return node->data;
+}
+
+// LBA of the structure that node n refers to
+static inline uint32_t node_sector(struct build* b, uint32_t n)
+{
+    if (n == 0 || n >= __atomic_load_n(&b->nodes_used, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Invalid node reference %u\n", n);
+        abort();
+    }
+    return node_at(b, n)->sector;
+}
+
+static void node_free(struct build* b)
+{
+    if (!b->node_chunks)
+        return;
+    for (uint32_t i = 0; i < b->node_chunk_count; i++)
+        free(b->node_chunks[i]);
+    free(b->node_chunks);
+}
+
+// Every FNODE, ALSEC, and DIRBLK lives until writeback, so instead of allocating them one at a time we carve them out of
+// large zeroed chunks, one arena per structure size, and release each arena in one go once everything is on disk.
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+static void* arena_alloc(struct build_thread* t, struct arena* a, int type)
+{
+    if (!a->chunks || a->used + a->object_size > ARENA_CHUNK_SIZE) {
+        struct arena_chunk* chunk = calloc(1, sizeof(struct arena_chunk) + ARENA_CHUNK_SIZE);
+        if (!chunk)
+            build_fail(t->b, "calloc: %s", strerror(errno));
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        a->used = 0;
+        a->bytes += ARENA_CHUNK_SIZE;
+    }
+    void* result = &a->chunks->data[a->used];
+    a->used += a->object_size;
+    t->arena_type_bytes[type] += a->object_size;
+    return result;
+}
+
+// Hand everything in 'from' over to 'to'. Its chunks go behind the one 'to' is allocating from, so that stays current.
+static void arena_merge(struct arena* to, struct arena* from)
+{
+    if (!from->chunks)
+        return;
+    if (to->chunks) {
+        struct arena_chunk* last = from->chunks;
+        while (last->next)
+            last = last->next;
+        last->next = to->chunks->next;
+        to->chunks->next = from->chunks;
+    } else {
+        to->chunks = from->chunks;
+        to->used = from->used;
+    }
+    to->bytes += from->bytes;
+    from->chunks = NULL;
+    from->bytes = 0;
+}
+
+static void arena_release(struct arena* a)
+{
+    struct arena_chunk *chunk = a->chunks, *next;
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->chunks = NULL;
+    a->bytes = 0;
+}
+
+static void arena_report(struct build* b)
+{
+    struct build_thread* t = &b->main_thread;
+    fprintf(stderr, "Metadata arenas:\n"
+                    "  %s: %llu bytes\n"
+                    "  %s: %llu bytes\n",
+        t->sector_arena.name, (unsigned long long)t->sector_arena.bytes,
+        t->dirblk_arena.name, (unsigned long long)t->dirblk_arena.bytes);
+    for (int i = SECTOR_ENTRY_DIRBLK; i <= SECTOR_ENTRY_FNODE; i++)
+        fprintf(stderr, "  %s structures: %llu bytes\n", names[i], (unsigned long long)t->arena_type_bytes[i]);
+}
+
+// Queue up a node's structure to be written to disk
+static void node_writeback(struct build* b, struct node* hte)
+{
+    switch (hte->type) {
+    case SECTOR_ENTRY_FNODE:
+#if PRINT_TYPES
+        fprintf(stderr, "FNODE at %x (nam15: ", hte->sector);
+        print_fnode_name(hte->data);
+#endif
+        if (hte->sector == 0) {
+            fprintf(stderr, "ERROR: sector should not be zero (likely a bug)\n");
+            abort();
+        }
+        hpfs_queue_write(b->vol, hte->data, 1, hte->sector);
+        break;
+    case SECTOR_ENTRY_DIRBLK:
+#if PRINT_TYPES
+        printf("DIRBLK at %x\n", hte->sector);
+#endif
+        if (hte->sector == 0) {
+            fprintf(stderr, "ERROR: sector should not be zero (likely a bug)\n");
+            abort();
+        }
+        if (((struct hpfs_dirblk*)hte->data)->signature != HPFS_DIRBLK_SIG) {
+            fprintf(stderr, "Dirblk has wrong sig\n");
+            abort();
+        }
+        hpfs_queue_write(b->vol, hte->data, 4, hte->sector);
+        break;
+    case SECTOR_ENTRY_ALSEC:
+#if PRINT_TYPES
+        printf("ALSEC at %x\n", hte->sector);
+#endif
+        if (hte->sector == 0) {
+            fprintf(stderr, "ERROR: sector should not be zero (likely a bug)\n");
+            abort();
+        }
+        if (((struct hpfs_alsec*)hte->data)->signature != HPFS_ALSEC_SIG) {
+            fprintf(stderr, "Alsec has wrong sig\n");
+            abort();
+        }
+        hpfs_queue_write(b->vol, hte->data, 1, hte->sector);
+        break;
+    }
+}
+
+static struct hpfs_dirblk* hpfs_new_dirblk(struct build_thread* t, uint32_t parent_lba)
+{
+    struct build* b = t->b;
+    struct hpfs_dirblk* db = arena_alloc(t, &t->dirblk_arena, SECTOR_ENTRY_DIRBLK);
+    db->parent_lba = parent_lba;
+    db->signature = HPFS_DIRBLK_SIG;
+    db->this_lba = node_add(b, alloc_dirband_sectors(t, 4), SECTOR_ENTRY_DIRBLK, db);
+    return db;
+}
+
+// If *this_lba is nonzero, the FNODE goes there (the sector has to be allocated already)
+static struct hpfs_fnode* hpfs_new_fnode(struct build_thread* t, uint32_t parent_lba, uint32_t* this_lba)
+{
+    struct build* b = t->b;
+    struct hpfs_fnode* fn = arena_alloc(t, &t->sector_arena, SECTOR_ENTRY_FNODE);
+    uint32_t lba = *this_lba ? *this_lba : alloc_sectors(t, 1);
+    *this_lba = lba;
+    fn->signature = HPFS_FNODE_SIG;
+    fn->container_dir_lba = parent_lba;
+    node_add(b, lba, SECTOR_ENTRY_FNODE, fn);
+    return fn;
+}
+
+// ===================================================
+// Everything to do with DIRENTs and DIRBLKS (B-Trees)
+// ===================================================
+// The general routine for adding goes as such:
+//  if (possible to add more entries to dirblk)
+//  then
+//      append entry to dirblk
+//  else
+//      split dirblk into half
+//      send median to parent
+//  endif
+
+// TODO: for POSIX subsystem
+#define CASESENS(de) 0
+
+// Whether dirblk is at the top of the chain
+#define DIRBLK_IS_TOP(blk) ((blk)->change & 1)
+// Maximum possible dirent size, including overflow
+#define MAX_DIRENT_SIZE (2048 + 0x124)
+// Determien whether dirent 'de' is an ending entry
+#define DIRENT_IS_END(de) (de->flags & HPFS_DIRENT_FLAGS_DUMMY_END)
+// Gets LBA for dirblk from FNODE
+#define FNODE_TO_DIRBLK_LBA(fn) (fn->btree_info_flag & 0x80) ? fn->alnodes[0].physical_lba : fn->alleafs[0].physical_lba
+// sets downlink
+#define SET_DOWNLINK(de, n) *(uint32_t*)(((void*)de) + de->size - 4) = n
+// gets downlink
+#define GET_DOWNLINK(de) *(uint32_t*)(((void*)de) + de->size - 4)
+// Get dirent data
+#define DE_DATA(de) ((struct hpfs_dirent*)(&de->data[0]))
+
+static void hpfs_set_dirblk_len(struct hpfs_dirblk* blk, struct hpfs_dirent* de)
+{
+    blk->first_free = (uintptr_t)de - (uintptr_t)blk;
+}
+// Add an end entry to the dirent. Returns a pointer to the next entry.
+static struct hpfs_dirent* hpfs_add_end(struct hpfs_dirent* de, uint32_t downlink)
+{
+    de->size = 32 + (downlink != 0) * 4;
+    de->namelen = 1;
+    de->name_stuff[0] = 0xFF;
+    if (downlink)
+        SET_DOWNLINK(de, downlink);
+    if (downlink)
+        de->flags = HPFS_DIRENT_FLAGS_DUMMY_END | HPFS_DIRENT_FLAGS_BTREE;
+    else
+        de->flags = HPFS_DIRENT_FLAGS_DUMMY_END;
+    return ((void*)de) + de->size;
+}
+// Add '..' entry to file. Returns a pointer to the next entry.
+static struct hpfs_dirent* hpfs_add_dotdot(struct build* b, struct hpfs_dirent* de, uint32_t parent)
+{
+    de->size = 36; // ((31 + 2) + 3) & ~3
+    de->atime = de->ctime = de->mtime = b->now;
+    de->attributes = HPFS_DIRENT_ATTR_DIRECTORY;
+    de->code_page_index = 0;
+    de->ea_size = 0;
+    de->filelen = 0;
+    de->flags = HPFS_DIRENT_FLAGS_SPECIAL;
+    de->flex = 0;
+    de->fnode_lba = parent;
+    de->namelen = 2;
+    de->name_stuff[0] = de->name_stuff[1] = 1;
+    return ((void*)de) + de->size;
+}
+
+// Count number of dirents in dirblk. Doesn't include end block.
+static int hpfs_count_dirents(struct hpfs_dirblk* dirblk)
+{
+    int offsz = 0, count = 0;
+    while (1) {
+        struct hpfs_dirent* dirent = (void*)(&dirblk->data[offsz]);
+        if (DIRENT_IS_END(dirent))
+            return count;
+        else {
+            count++;
+            offsz += dirent->size;
+            if (offsz > MAX_DIRENT_SIZE) {
+                // We should have encountered an END dirent by now; otherwise, this entry is malformed.
+                fprintf(stderr, "hpfs_count_dirents: Dirblk doesn't contain end dirent\n"
+                                "dirblk lba: 0x%x parent lba: 0x%x\n",
+                    dirblk->this_lba, dirblk->parent_lba);
+                abort();
+            }
+        }
+    }
+}
+
+#define DOFFS(dirblk, offs) (((void*)dirblk) + offs)
+#define DIRBLK_HDR_SIZE 0x14
+// Iterate through a dirblk
+#define DIRBLK_ITER(varn, dirblk)                                  \
+    struct hpfs_dirent* __end = DOFFS(dirblk, dirblk->first_free); \
+    for (struct hpfs_dirent* varn = (void*)(dirblk->data); varn < __end; varn = hpfs_next_de(varn))
+
+static inline struct hpfs_dirent* hpfs_next_de(struct hpfs_dirent* dirent)
+{
+    if (dirent->size == 0) {
+        fprintf(stderr, "dirent with size 0\n");
+        abort();
+    }
+    return ((void*)dirent) + dirent->size;
+}
+
+// We know that there is enough room within dirblk to insert de.
+static void hpfs_insert_dirblk_nosplit(struct hpfs_dirblk* dirblk, struct hpfs_dirent* de)
+{
+    //fprintf(stderr, "ITERLIST : ");
+    //print_dirent_name(de);
+    DIRBLK_ITER(cur, dirblk)
+    {
+#if 0
+        if (!DIRENT_IS_END(cur)) {
+            fprintf(stderr, "  NAME: ");
+            print_dirent_name(cur);
+        }
+#endif
+        if (
+            DIRENT_IS_END(cur) // we've reached the end of the chain and found nothing
+            || fncompare(cur->name_stuff, cur->namelen, de->name_stuff, de->namelen, CASESENS(de)) > 0 // We have to insert it before the next one, to preserve case-order
+            ) {
+            // Insert it here
+            // Move the other ents back (note that these are most likely overlapping)
+            int offset = (uintptr_t)cur - (uintptr_t)dirblk;
+            memmove(((void*)cur) + de->size, cur, dirblk->first_free - offset);
+            // ... and insert ours here
+            memcpy((void*)cur, de, de->size);
+            // Update the size
+            dirblk->first_free += de->size;
+            return;
+        }
+    }
+}
+
+// Follow a link to a dirblk
+static struct hpfs_dirblk* hpfs_get_dirblk(struct build* b, uint32_t n)
+{
+    return node_get(b, n, SECTOR_ENTRY_DIRBLK);
+}
+
+// Determine the offset in dirblk->data of dirent number #offset
+// Also could be used to determine the size of #(offset - 1) dirents
+static int hpfs_offsetof_dirblk(struct hpfs_dirblk* dirblk, int offset)
+{
+    int offs = 0;
+    for (int i = 0; i < offset; i++) {
+        struct hpfs_dirent* dirent = (void*)(&dirblk->data[offs]);
+        if (dirent->flags & HPFS_DIRENT_FLAGS_DUMMY_END) {
+            if (i != (offset - 1)) {
+                // there were 2 entries in the dirblk, but we asked for the index of the third
+                fprintf(stderr, "hpfs_offsetof_dirblk: Out of range (dirblk=0x%x, offset=%d)\n", dirblk->this_lba, offset);
+                return -1;
+            }
+        }
+        offs += dirent->size;
+    }
+    return offs;
+}
+
+// Clear a dirblk and set "de" as the only directory entry.
+static void hpfs_dirblk_setonly(struct hpfs_dirblk* dirblk, struct hpfs_dirent* de, uint32_t downlink_de, uint32_t downlink_end)
+{
+    struct hpfs_dirent* d = (void*)&dirblk->data[0];
+    memcpy(d, de, de->size);
+    if (downlink_de) {
+        if (!(d->flags & HPFS_DIRENT_FLAGS_BTREE)) { // If we haven't already, make room
+            d->size += 4;
+            d->flags |= HPFS_DIRENT_FLAGS_BTREE;
+        }
+        SET_DOWNLINK(d, downlink_de);
+    }
+    d = hpfs_next_de(d);
+    d = hpfs_add_end(d, downlink_end);
+    hpfs_set_dirblk_len(dirblk, d);
+}
+
+// Adds a complete dirent entry, de, to dirblk. Creates subdirblks if needed
+// Note that "dirblk" should be the lowest leaf in the B-tree.
+static void hpfs_add_dirent_internal(struct build_thread* t, struct hpfs_dirblk* dirblk, struct hpfs_dirent* de)
+{
+    struct build* b = t->b;
+    while (1) {
+        // Check if we have enough room to insert this into the dirblk
+        if ((dirblk->first_free + de->size) < sizeof(struct hpfs_dirblk)) {
+            // Yes we do. Insert it in the right location
+            hpfs_insert_dirblk_nosplit(dirblk, de);
+            return;
+        }
+
+        // we need to split
+        // TODO: eliminate the use of malloc
+        if (!t->temp_dirblk)
+            t->temp_dirblk = malloc(2048 + 0x124 + 16);
+
+        // Copy the dirblk into our temporary space.
+        memcpy(t->temp_dirblk, dirblk, dirblk->first_free);
+        // Insert our new entry into the sorted list
+        hpfs_insert_dirblk_nosplit(t->temp_dirblk, de);
+        //print_dirblk(temp_dirblk);
+
+        int is_top = DIRBLK_IS_TOP(dirblk);
+        uint32_t new_parent_lba = is_top
+            ? dirblk->this_lba // We reuse this dirblk for the top entry
+            : dirblk->parent_lba; // No parents are being modified
+
+        // Determine the positions and addresses of our new dirblks
+        struct hpfs_dirblk *left = hpfs_new_dirblk(t, new_parent_lba),
+                           *right = is_top ? hpfs_new_dirblk(t, new_parent_lba) : dirblk,
+                           *top = is_top ? dirblk : NULL;
+
+        //printf("Splitting dirblk! (%d - lsn: %x) top? %d\n", dirblk->first_free, dirblk->this_lba, is_top);
+        struct hpfs_dirent* median;
+        // Determine the median
+        {
+            int median_index = (t->temp_dirblk->first_free - 0x14) / 2;
+            struct hpfs_dirent* de_mid = DOFFS(t->temp_dirblk, median_index);
+            median = (struct hpfs_dirent*)&t->temp_dirblk->data[0];
+            // Find the first block before the median.
+            int n = 0, k = 0;
+            while (median < de_mid) {
+                k += median->size;
+                median = hpfs_next_de(median);
+            }
+
+            // Copy the first blocks before the median into the left dirblk.
+            // We preserve the header because we worked hard to make it!
+            int leftlen = (uintptr_t)median - (uintptr_t)(&t->temp_dirblk->data[0]);
+            struct hpfs_dirent *leftent = (struct hpfs_dirent *)&left->data[0],
+                               *lefttemp;
+            memcpy(leftent, &t->temp_dirblk->data[0], leftlen);
+            leftent = DOFFS(leftent, leftlen);
+
+            // Duplicate the median's downlink in our end entry, if it has one
+            if (median->flags & HPFS_DIRENT_FLAGS_BTREE)
+                leftent = hpfs_add_end(leftent, GET_DOWNLINK(median));
+            else
+                leftent = hpfs_add_end(leftent, 0);
+            // Set the length of the dirent
+            hpfs_set_dirblk_len(left, leftent);
+            //fprintf(stderr, " == LEFT (%x) ==\n", left->this_lba);
+            //print_dirblk(left);
+
+            // =======================
+            // Handle the right dirblk
+            // =======================
+
+            struct hpfs_dirent* after_med = hpfs_next_de(median);
+            int after_med_offset = (uintptr_t)after_med - (uintptr_t)&t->temp_dirblk->data[0],
+                copy_len = t->temp_dirblk->first_free - after_med_offset; // first_free includes DIRBLK_HDR_SIZE
+            memcpy(&right->data[0], after_med, copy_len - DIRBLK_HDR_SIZE); // TODO: right calculation is wrong
+            // Adjust the length of the first free entry
+            right->first_free = copy_len /* + DIRBLK_HDR_SIZE*/;
+            //fprintf(stderr, " == RIGHT (%x) ==\n", right->this_lba);
+            //print_dirblk(right);
+
+            // ======
+            // Fixups
+            // ======
+            // If we created a new dirblk for left and/or right and we're not dealing with a leaf node, then fix up the block addresses
+            if (median->flags & HPFS_DIRENT_FLAGS_BTREE) {
+                // Fix up all of our left uplinks to match this parent
+                DIRBLK_ITER(cur, left)
+                {
+                    // For each entry in "left," get the dirblk pointed to by its downlink pointer and modify its parent_lba field.
+                    hpfs_get_dirblk(b, GET_DOWNLINK(cur))->parent_lba = left->this_lba;
+                }
+                // Fix the right ones too, if needed
+                if (is_top) {
+                    DIRBLK_ITER(cur, right)
+                    {
+                        hpfs_get_dirblk(b, GET_DOWNLINK(cur))->parent_lba = right->this_lba;
+                    }
+                }
+            }
+        }
+
+        // sanity check
+        int right_ents = right->first_free - DIRBLK_HDR_SIZE;
+        int left_ents = left->first_free - DIRBLK_HDR_SIZE;
+        int temp_ents = t->temp_dirblk->first_free - DIRBLK_HDR_SIZE + 36 - de->size; // add an extra end entry
+        //printf("l=%d r=%d l+r=%d expected=%d\n", left_ents, right_ents, left_ents + right_ents, temp_ents);
+
+        //printf("left=%d [%x] right=%d [%x] dirblk=%d [%x]\n", left->first_free, left->this_lba, right->first_free, right->this_lba, dirblk->first_free, dirblk->this_lba);
+
+        // We have to be careful about changing links while promoting blocks.
+        // The simplest case is a simple promotion from the lowest level to the next highest one. Since the median being promoted doesn't contain any downlinks, we're free to modify it as we see fit.
+        // But what if we're promoting a mid-level block? Then it gets messy.
+        // Suppose we had a tree that looked like this:
+        //
+        //         [A   B   C   E   *]
+        //         /   /   /   /   /
+        //       [1] [2] [3] [4] [5]
+        // Block 1 contains entries like "Add" and "Apple"
+        // Block 2 contains entries like "Baby" and "Bath"
+        // Block 3 contains entries like "Cat" and "C++"
+        // So on and so forth
+        //
+        // The * denotes an ending dirblk
+        //
+        // Suppose that we promoted D, with its own dirblk chain.
+        //
+        //         [A   B   C  <D>  E   *]:0
+        //         /   /   /   /   /   /
+        //       [1] [2] [3] [6] [4] [5]
+        //
+        // Note that the '6' now simply points to the dirblk number containing entries like "Dirent" and "Directory." It says nothing about its alphabetical position
+        // Let's say that it forced us to do another round of promotions:
+        //                 8:[C           *]
+        //                   /           /
+        //       7:[A   B   *]  [D   E  *]:0
+        //         /   /   /    /   /   /
+        //       [1] [2] [3]  [6] [4] [5]
+        //
+        // Here's how the dirblks are shunted around:
+        //  - Dirent C now contains a link to the left dirblk, and a newly created END entry contains a link to the original.
+        //  - The entire right dirblk keeps its downlinks exactly as they were.
+        //  - C's downlink now migrates to the ending dirent of the left block.
+
+        //
+        // Add the left downlink we created and mark it having one
+        //median->flags |= HPFS_DIRENT_FLAGS_BTREE;
+        //SET_DOWNLINK(median, left->this_lba); // this line is done later
+
+        if (is_top) { // If the dirblk we just split was the top
+            // Promote median -- make it the only thing in the new root
+            hpfs_dirblk_setonly(dirblk, median, left->this_lba, right->this_lba);
+            return;
+        } else {
+            // There's no need to add the right dirent -- it's supposed to be attached to the dirent after this one
+            if (!t->temp_dirent)
+                t->temp_dirent = malloc(0x124);
+
+            // In some cases, we might promote the same median over and over again.
+            // If so, then temp_dirent == median, and memcpy doesn't like that
+            if (t->temp_dirent != median) // Promote the median into the next one
+                memcpy(t->temp_dirent, median, median->size);
+
+            // Adjust the temporary dirent. If the median came from an internal DIRBLK, it already has a downlink, but its
+            // old child now hangs off the END entry of left, so it has to point to left like any other promoted median.
+            if (!(t->temp_dirent->flags & HPFS_DIRENT_FLAGS_BTREE)) {
+                t->temp_dirent->flags |= HPFS_DIRENT_FLAGS_BTREE;
+                t->temp_dirent->size += 4;
+            }
+            SET_DOWNLINK(t->temp_dirent, left->this_lba);
+
+            // Get the parent
+            dirblk = hpfs_get_dirblk(b, dirblk->parent_lba);
+            de = t->temp_dirent;
+        }
+    }
+}
+
+// Call this routine to add dirents to a dirblk correctly. It traverses the dirblk b-tree and passes the appropriate parameters to hpfs_add_dirent_internal
+static void hpfs_add_dirent(struct build_thread* t, struct hpfs_dirblk* dirblk, struct hpfs_dirent* de)
+{
+    struct build* b = t->b;
+top : {
+    DIRBLK_ITER(cur, dirblk)
+    {
+        if (DIRENT_IS_END(cur) || fncompare(cur->name_stuff, cur->namelen, de->name_stuff, de->namelen, CASESENS(cur)) > 0) {
+            // The entry goes in between us and the next
+            if (cur->flags & HPFS_DIRENT_FLAGS_BTREE) {
+                // Go down the tree
+                dirblk = hpfs_get_dirblk(b, GET_DOWNLINK(cur));
+                goto top;
+            } else { // We've arrived on the lowest entry
+                hpfs_add_dirent_internal(t, dirblk, de);
+                return;
+            }
+        }
+    }
+}
+}
+// ============================================================================
+// Bulk loading. When we're creating a brand new directory, we know all of its entries ahead of time, so instead of
+// inserting them one at a time we sort them and build the B-tree from the bottom up, packing every DIRBLK full.
+// ============================================================================
+
+// Pack a sorted run of dirents into a row of DIRBLKs. If this isn't the bottom level, children has count + 1 entries:
+// children[i] is the downlink for ents[i], and children[count] is the downlink for the END entry of the last DIRBLK.
+// The dirents that end up between two DIRBLKs are stored in promoted (which must have room for count entries), and
+// the number of them is returned. The DIRBLKs are stored in row, and there's always one more of them than promoted dirents.
+static int hpfs_pack_dirblks(struct build_thread* t, struct hpfs_dirent** ents, int count, struct hpfs_dirblk** children,
+    struct hpfs_dirblk** row, struct hpfs_dirent** promoted)
+{
+    int downlink = children ? 4 : 0, npromoted = 0, i = 0;
+    // Everything has to fit in front of the END entry, with first_free staying below sizeof(struct hpfs_dirblk)
+    int capacity = sizeof(struct hpfs_dirblk) - 1 - DIRBLK_HDR_SIZE - (32 + downlink);
+    while (1) {
+        int first = i, used = 0;
+        while (i < count && used + ents[i]->size + downlink <= capacity)
+            used += ents[i++]->size + downlink;
+        // If the entry after this DIRBLK would be the very last one, then the next DIRBLK would be empty. Give it the
+        // last entry of this DIRBLK instead.
+        if (i == count - 1)
+            i--;
+
+        struct hpfs_dirblk* blk = hpfs_new_dirblk(t, 0);
+        struct hpfs_dirent* d = DE_DATA(blk);
+        for (int j = first; j < i; j++) {
+            memcpy(d, ents[j], ents[j]->size);
+            if (children) {
+                d->size += 4;
+                d->flags |= HPFS_DIRENT_FLAGS_BTREE;
+                SET_DOWNLINK(d, children[j]->this_lba);
+                children[j]->parent_lba = blk->this_lba;
+            }
+            d = hpfs_next_de(d);
+        }
+        // The END entry points to whatever comes between our last entry and the next promoted one
+        if (children)
+            children[i]->parent_lba = blk->this_lba;
+        d = hpfs_add_end(d, children ? children[i]->this_lba : 0);
+        hpfs_set_dirblk_len(blk, d);
+        row[npromoted] = blk;
+
+        if (i >= count)
+            return npromoted;
+        promoted[npromoted++] = ents[i++];
+    }
+}
+
+// Build a complete DIRBLK B-tree out of a sorted array of dirents (including '..') and return the top DIRBLK
+static struct hpfs_dirblk* hpfs_build_dirblk_tree(struct build_thread* t, struct hpfs_dirent** ents, int count, uint32_t fnode_lba)
+{
+    struct hpfs_dirblk **row = malloc((count + 1) * sizeof(struct hpfs_dirblk*)), **children = NULL;
+    struct hpfs_dirent** promoted = malloc(count * sizeof(struct hpfs_dirent*));
+    struct hpfs_dirent** level = ents;
+    int n = count;
+    while (1) {
+        int npromoted = hpfs_pack_dirblks(t, level, n, children, row, promoted);
+        if (npromoted == 0)
+            break;
+        // The DIRBLKs we just created are the children of the next level up, and the promoted dirents are its entries
+        free(children);
+        children = row;
+        row = malloc((npromoted + 1) * sizeof(struct hpfs_dirblk*));
+        if (level != ents)
+            free(level);
+        level = promoted;
+        promoted = malloc(npromoted * sizeof(struct hpfs_dirent*));
+        n = npromoted;
+    }
+    struct hpfs_dirblk* top = row[0];
+    top->change = 1;
+    top->parent_lba = fnode_lba;
+
+    free(row);
+    free(children);
+    free(promoted);
+    if (level != ents)
+        free(level);
+    return top;
+}
+
+// Get directory fnode that's already on disk
+static struct hpfs_fnode* hpfs_get_ondisk_fnode(struct build* b, uint32_t lba)
+{
+    struct hpfs_fnode* fnode = malloc(512);
+    if (hpfs_read_sectors(b->vol, fnode, 1, lba))
+        goto fail;
+
+    if (fnode->signature != HPFS_FNODE_SIG)
+        goto fail; // Not a fnode
+
+    if (!(fnode->dir_flag & 1))
+        goto fail; // Not a directory
+
+    return fnode;
+fail:
+    free(fnode);
+    return NULL;
+}
+
+static struct hpfs_dirblk* hpfs_get_ondisk_dirblk(struct build* b, uint32_t lba)
+{
+    struct hpfs_dirblk* dirblk = malloc(2048);
+    if (hpfs_read_sectors(b->vol, dirblk, 4, lba))
+        goto fail;
+
+    if (dirblk->signature != HPFS_DIRBLK_SIG)
+        goto fail; // Not a fnode
+    return dirblk;
+fail:
+    free(dirblk);
+    return NULL;
+}
+
+static void concatpath(char* dest, char* p1, int p1l, char* p2)
+{
+    // Copy dest name characters
+    memcpy(dest, p1, p1l);
+    // Add terminating slash to very end
+    if (p1[p1l - 1] != '/')
+        dest[p1l++] = '/';
+    // Copy string and include final pointer.
+    strcpy(dest + p1l, p2);
+}
+
+// Determine whether a name would be considered "long" by HPFS.
+// This routine handles names of the form 'NAME.EXT,' not the 'NAME    EXT' of FAT
+// Why does HPFS care about long names? It's not like they're handled differently.
+static inline int is_longname(char* name)
+{
+    int len = strlen(name);
+    if (len > 12)
+        return 1; // longer than the maximum possible 8.3 filename
+    if (name[0] == '.')
+        return 1; // FAT names can't start with a dot
+
+    char* dot = strchr(name, '.');
+    // COMMAND.COM --> "COMMAND".length === 8
+    int pre_len = dot ? (int)((uintptr_t)dot - (uintptr_t)name) : len;
+    if (pre_len > 8)
+        return 1;
+
+    if (dot) {
+        // COMMAND.COM --> "COM".length === 3
+        int extlen = len - pre_len - 1;
+        if (extlen > 3 || strchr(dot + 1, '.') || dot[-1] == ' ')
+            return 1;
+    }
+    // Characters that FAT doesn't allow in a name
+    for (char* p = name; *p; p++)
+        if ((uint8_t)*p < 0x20 || strchr("\"*+,/;:<=>?[\\]|", *p))
+            return 1;
+    return 0;
+}
+
+static inline uint8_t stat2attr(struct stat* statbuf)
+{
+    uint8_t attr = 0;
+    if (S_ISDIR(statbuf->st_mode))
+        attr |= HPFS_DIRENT_ATTR_DIRECTORY;
+    // that's all i can think of for now
+    return attr;
+}
+
+// ===============================================
+// Everything to do with FNODEs and AL*s (B+Trees)
+// ===============================================
+
+static struct hpfs_alsec* hpfs_new_alsec(struct build_thread* t, int flags, uint32_t parent)
+{
+    struct build* b = t->b;
+    int sec = alloc_sectors(t, 1);
+    struct hpfs_alsec* al = arena_alloc(t, &t->sector_arena, SECTOR_ENTRY_ALSEC);
+    al->signature = HPFS_ALSEC_SIG;
+    al->btree_flag = flags;
+    al->free_entries = flags & HPFS_BTREE_ALNODES ? HPFS_ALNODES_PER_ALSEC : HPFS_ALLEAFS_PER_ALSEC;
+    al->used_entries = 0;
+    al->free_entry_offset = sizeof(struct hpfs_btree_header);
+    al->parent_lba = parent;
+    al->this_lba = node_add(b, sec, SECTOR_ENTRY_ALSEC, al);
+    return al;
+}
+
+// Set the offset of the first free byte after a B+tree header's entries, from how many of them are used
+static void hpfs_hdr_compute_free(struct hpfs_btree_header* hdr)
+{
+    if (hdr->flag & HPFS_BTREE_ALNODES)
+        hdr->free_offset = sizeof(struct hpfs_btree_header) + hdr->used * sizeof(struct hpfs_alnode);
+    else // alleaf
+        hdr->free_offset = sizeof(struct hpfs_btree_header) + hdr->used * sizeof(struct hpfs_alleaf);
+}
+
+// Fill in a B+tree header holding 'used' out of 'capacity' entries
+static void hpfs_set_btree_hdr(struct hpfs_btree_header* hdr, int flag, int used, int capacity)
+{
+    hdr->flag = flag;
+    hdr->used = used;
+    hdr->free = capacity - used;
+    hpfs_hdr_compute_free(hdr);
+}
+
+// Build the B+tree for a file out of its complete list of extents, which must be in ascending logical order (they always
+// are, since we allocate a file front to back). The tree is built from the bottom up: ALLEAFs are packed 40 to an ALSEC,
+// those ALSECs are pointed to by ALNODEs packed 60 to an ALSEC, and so on until what's left fits in the FNODE itself.
+// Every ALNODE holds the first file sector that its subtree doesn't map, except for the last one in each node, which is -1.
+static void hpfs_build_extent_tree(struct build_thread* t, struct hpfs_fnode* fnode, uint32_t fnode_lba, struct hpfs_alleaf* extents, int count)
+{
+    if (count <= HPFS_ALLEAFS_PER_FNODE) {
+        memcpy(fnode->alleafs, extents, count * sizeof(struct hpfs_alleaf));
+        hpfs_set_btree_hdr(&fnode->btree_hdr, 0, count, HPFS_ALLEAFS_PER_FNODE);
+        return;
+    }
+
+    // row[] holds the ALSECs on the current level, and level[] holds the ALNODE that will point to each of them
+    int n = (count + HPFS_ALLEAFS_PER_ALSEC - 1) / HPFS_ALLEAFS_PER_ALSEC;
+    struct hpfs_alsec** row = malloc(n * sizeof(struct hpfs_alsec*));
+    struct hpfs_alnode* level = malloc(n * sizeof(struct hpfs_alnode));
+    for (int i = 0; i < n; i++) {
+        int first = i * HPFS_ALLEAFS_PER_ALSEC, used = count - first;
+        if (used > HPFS_ALLEAFS_PER_ALSEC)
+            used = HPFS_ALLEAFS_PER_ALSEC;
+        struct hpfs_alsec* alsec = hpfs_new_alsec(t, 0, 0);
+        memcpy(alsec->alleafs, &extents[first], used * sizeof(struct hpfs_alleaf));
+        hpfs_set_btree_hdr(&alsec->btree, 0, used, HPFS_ALLEAFS_PER_ALSEC);
+
+        struct hpfs_alleaf* last = &extents[first + used - 1];
+        level[i].end_sector_count = last->logical_lba + last->run_size;
+        level[i].physical_lba = alsec->this_lba;
+        row[i] = alsec;
+    }
+
+    while (n > HPFS_ALNODES_PER_FNODE) {
+        // Group (up to) 60 ALSECs under each ALSEC of the next level. Entry i of the new level is written only after
+        // entries i*60 onwards of the old one have been read, so both arrays can be reused in place.
+        int up = (n + HPFS_ALNODES_PER_ALSEC - 1) / HPFS_ALNODES_PER_ALSEC;
+        for (int i = 0; i < up; i++) {
+            int first = i * HPFS_ALNODES_PER_ALSEC, used = n - first;
+            if (used > HPFS_ALNODES_PER_ALSEC)
+                used = HPFS_ALNODES_PER_ALSEC;
+            struct hpfs_alsec* alsec = hpfs_new_alsec(t, HPFS_BTREE_ALNODES, 0);
+            memcpy(alsec->alnodes, &level[first], used * sizeof(struct hpfs_alnode));
+            alsec->alnodes[used - 1].end_sector_count = -1;
+            hpfs_set_btree_hdr(&alsec->btree, HPFS_BTREE_ALNODES, used, HPFS_ALNODES_PER_ALSEC);
+            for (int j = first; j < first + used; j++)
+                row[j]->parent_lba = alsec->this_lba;
+
+            level[i].end_sector_count = level[first + used - 1].end_sector_count;
+            level[i].physical_lba = alsec->this_lba;
+            row[i] = alsec;
+        }
+        n = up;
+    }
+
+    // Whatever is left goes into the FNODE
+    memcpy(fnode->alnodes, level, n * sizeof(struct hpfs_alnode));
+    fnode->alnodes[n - 1].end_sector_count = -1;
+    hpfs_set_btree_hdr(&fnode->btree_hdr, HPFS_BTREE_ALNODES, n, HPFS_ALNODES_PER_FNODE);
+    for (int i = 0; i < n; i++) {
+        row[i]->btree.flag |= HPFS_BTREE_PARENT_IS_FNODE;
+        row[i]->parent_lba = fnode_lba;
+    }
+
+    free(row);
+    free(level);
+}
+
+// Turn every node number in the DIRBLK and ALSEC B-trees back into an LBA. Links can't be followed after this.
+static void nodes_serialize(struct build* b)
+{
+    for (uint32_t i = 1; i < b->nodes_used; i++) {
+        struct node* node = node_at(b, i);
+        switch (node->type) {
+        case SECTOR_ENTRY_DIRBLK: {
+            struct hpfs_dirblk* blk = node->data;
+            DIRBLK_ITER(cur, blk)
+            {
+                if (cur->flags & HPFS_DIRENT_FLAGS_BTREE)
+                    SET_DOWNLINK(cur, node_sector(b, GET_DOWNLINK(cur)));
+            }
+            if (!DIRBLK_IS_TOP(blk))
+                blk->parent_lba = node_sector(b, blk->parent_lba);
+            blk->this_lba = node->sector;
+            break;
+        }
+        case SECTOR_ENTRY_ALSEC: {
+            struct hpfs_alsec* al = node->data;
+            if (al->btree.flag & HPFS_BTREE_ALNODES)
+                for (int j = 0; j < al->btree.used; j++)
+                    al->alnodes[j].physical_lba = node_sector(b, al->alnodes[j].physical_lba);
+            if (!(al->btree.flag & HPFS_BTREE_PARENT_IS_FNODE))
+                al->parent_lba = node_sector(b, al->parent_lba);
+            al->this_lba = node->sector;
+            break;
+        }
+        case SECTOR_ENTRY_FNODE: {
+            struct hpfs_fnode* fn = node->data;
+            if (fn->btree_hdr.flag & HPFS_BTREE_ALNODES)
+                for (int j = 0; j < fn->btree_hdr.used; j++)
+                    fn->alnodes[j].physical_lba = node_sector(b, fn->alnodes[j].physical_lba);
+            else if (fn->dir_flag & HPFS_FNODE_ISDIR)
+                fn->alleafs[0].physical_lba = node_sector(b, fn->alleafs[0].physical_lba); // Top DIRBLK
+            break;
+        }
+        }
+    }
+}
+
+static struct hpfs_dirblk* add_host_dir(struct build_thread* t, uint32_t fnode_lba, uint32_t parent_fnode_lba, char* hostdir);
+
+// File data is copied an extent at a time. copy_file_range lets the kernel do the copy (and share blocks on filesystems
+// that support reflinks); if it can't, or if writes can be queued (-I uring), the file is read into write buffers from
+// libhpfs, which are then written while the next ones are being filled. If the image is held in memory (-I mmap or
+// memory), files are read straight into it instead.
+
+// Copy len bytes from offset src_offset of host file fd2 to sector dest_sector of the image, zero-filling the rest of the final sector
+static void copy_file_data(struct build* b, int fd2, off_t src_offset, uint32_t dest_sector, uint32_t len)
+{
+    uint64_t dest_offset = (uint64_t)dest_sector << 9;
+    uint32_t left = len, padded = (len + 511) & ~511;
+    // If the image is in memory, the file can be read straight into it
+    uint8_t* dest = hpfs_map_sectors(b->vol, dest_sector, padded >> 9);
+    while (dest && left) {
+        ssize_t got = pread(fd2, dest + (len - left), left, src_offset);
+        if (got < 0)
+            build_fail(b, "read file: %s", strerror(errno));
+        if (got == 0)
+            break;
+        src_offset += got;
+        left -= got;
+    }
+    if (dest)
+        memset(dest + (len - left), 0, padded - (len - left));
+#ifdef __linux__
+    off_t out_offset = dest_offset + ((uint64_t)b->vol->partition_base << 9);
+    while (!dest && left && !b->copy_file_range_broken) {
+        ssize_t copied = copy_file_range(fd2, &src_offset, b->vol->fd, &out_offset, left, 0);
+        if (copied < 0) {
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) {
+                b->copy_file_range_broken = 1; // Don't bother trying again
+                break;
+            }
+            build_fail(b, "copy_file_range: %s", strerror(errno));
+        }
+        if (copied == 0)
+            break; // File got shorter since we stat'ed it
+        left -= copied;
+    }
+#endif
+    // Whatever's left goes through write buffers, up to the end of the last sector. The part past the end of the file,
+    // along with anything the file lost since we stat'ed it, is filled with zeros.
+    uint32_t copied = len - left, done = copied, eof = 0;
+    dest_offset += done;
+    while (!dest && done < padded) {
+        uint32_t chunk = padded - done < HPFS_WRITE_BUFFER_SIZE ? padded - done : HPFS_WRITE_BUFFER_SIZE;
+        uint32_t want = eof ? 0 : len - copied < chunk ? len - copied : chunk, got = 0;
+        uint8_t* buffer = hpfs_get_write_buffer(b->vol);
+        if (!buffer)
+            build_fail(b, NULL);
+        while (got < want) {
+            ssize_t n = pread(fd2, buffer + got, want - got, src_offset);
+            if (n < 0) {
+                hpfs_put_write_buffer(b->vol, buffer);
+                build_fail(b, "read file: %s", strerror(errno));
+            }
+            if (n == 0) {
+                eof = 1;
+                break;
+            }
+            src_offset += n;
+            got += n;
+        }
+        memset(buffer + got, 0, chunk - got);
+        if (hpfs_submit_write_buffer(b->vol, buffer, chunk, dest_offset))
+            build_fail(b, NULL);
+        copied += got;
+        done += chunk;
+        dest_offset += chunk;
+    }
+    build_lock(b);
+    b->bytes_copied += copied;
+    build_unlock(b);
+}
+// Write len bytes of prefetched file data to sector dest_sector of the image. The buffer is zero-padded to a whole number of sectors.
+static void write_file_data(struct build* b, uint8_t* data, uint32_t dest_sector, uint32_t len)
+{
+    uint32_t secs = (len + 511) >> 9;
+    uint8_t* dest = hpfs_map_sectors(b->vol, dest_sector, secs);
+    if (dest)
+        memcpy(dest, data, secs << 9);
+    else if (!b->vol->queue_depth) {
+        if (hpfs_write_sectors(b->vol, data, secs, dest_sector))
+            build_fail(b, NULL);
+    } else {
+        // data is gone as soon as we return, so the queued writes need their own copy
+        for (uint32_t done = 0; done < secs << 9; done += HPFS_WRITE_BUFFER_SIZE) {
+            uint32_t chunk = (secs << 9) - done < HPFS_WRITE_BUFFER_SIZE ? (secs << 9) - done : HPFS_WRITE_BUFFER_SIZE;
+            uint8_t* buffer = hpfs_get_write_buffer(b->vol);
+            if (!buffer)
+                build_fail(b, NULL);
+            memcpy(buffer, data + done, chunk);
+            if (hpfs_submit_write_buffer(b->vol, buffer, chunk, ((uint64_t)dest_sector << 9) + done))
+                build_fail(b, NULL);
+        }
+    }
+}
+
+// ============================================================================
+// Host tree pipeline
+// ============================================================================
+// With -j N, one scanner thread walks the host tree (readdir, sort, stat) and N reader threads prefetch file contents,
+// while the main thread allocates extents, writes file data, and builds every bit of metadata. Without -j, the main
+// thread does all of this itself. Either way, directories are handed out in the order the main thread consumes them:
+// a directory's listing, then each of its subdirectories' listings depth-first. Within a directory, files are added
+// before subdirectories, so file data is consumed in exactly the order it is scanned and the image comes out the same
+// regardless of the number of threads.
+
+// One entry of a host directory
+struct host_file {
+    char* path;
+    char* name; // Points into path
+    struct stat st;
+
+    // Prefetched contents (zero-padded to a whole sector), or NULL if the main thread should copy the file itself
+    uint8_t* data;
+    uint32_t data_len;
+    int prefetched; // Set once data is ready
+    struct host_file* next; // Next file in the prefetch queue
+
+    // With -l: where the FNODE goes, and the file's data extents in plan_extent_list
+    uint32_t plan_sector, plan_extent, plan_extents;
+};
+
+// The sorted contents of one host directory
+struct host_listing {
+    char* path;
+    struct host_file* files;
+    int count;
+    struct host_listing* next;
+};
+
+// Only files up to PREFETCH_MAX_FILE bytes are prefetched; larger ones go through copy_file_data as usual. At most
+// PREFETCH_BYTES of file data is buffered at once.
+#define PREFETCH_BYTES (64 << 20)
+#define PREFETCH_MAX_FILE (PREFETCH_BYTES / 8)
+
+
+static int host_name_compare(const void* a, const void* b)
+{
+    char *x = *(char* const*)a, *y = *(char* const*)b;
+    int xlen = strlen(x), ylen = strlen(y);
+    // Names get truncated to 254 characters, so that's all that counts for ordering
+    return fncompare(x, xlen > 254 ? 254 : xlen, y, ylen > 254 ? 254 : ylen, CASESENS(x));
+}
+
+// Skip the . and .. entries that readdir gives us
+static int is_dot_or_dotdot(char* name)
+{
+    // '.' can lead to '.\0' or '..'
+    return name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+}
+
+// Read, sort and stat everything in host directory 'hostdir'. Files that can't be stat'ed are left out.
+static struct host_listing* scan_host_dir(struct build* b, char* hostdir)
+{
+    DIR* dir = opendir(hostdir);
+    struct dirent* entry;
+    if (!dir)
+        build_fail(b, "Error opening directory '%s'", hostdir);
+
+    char** names = NULL;
+    int count = 0, capacity = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (is_dot_or_dotdot(entry->d_name))
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity << 1 : 64;
+            names = realloc(names, capacity * sizeof(char*));
+        }
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char*), host_name_compare);
+
+    struct host_listing* listing = calloc(1, sizeof(struct host_listing));
+    listing->path = strdup(hostdir);
+    listing->files = calloc(count ? count : 1, sizeof(struct host_file));
+    int p1l = strlen(hostdir);
+    for (int i = 0; i < count; i++) {
+        struct host_file* hf = &listing->files[listing->count];
+        hf->path = malloc(p1l + 1 + strlen(names[i]) + 1);
+        concatpath(hf->path, hostdir, p1l, names[i]);
+        hf->name = hf->path + strlen(hf->path) - strlen(names[i]); // hostdir might already end in a slash
+        free(names[i]);
+        if (stat(hf->path, &hf->st) < 0) {
+            free(hf->path);
+            continue;
+        }
+        if (!S_ISDIR(hf->st.st_mode) && hf->st.st_size > UINT32_MAX) {
+            fprintf(stderr, "File '%s' is too big to fit in a HPFS volume. Skipping.\n", hf->path);
+            free(hf->path);
+            continue;
+        }
+        listing->count++;
+    }
+    free(names);
+    return listing;
+}
+
+static void free_host_listing(struct host_listing* listing)
+{
+    for (int i = 0; i < listing->count; i++) {
+        free(listing->files[i].path);
+        free(listing->files[i].data); // Only there if the build failed before it was used
+    }
+    free(listing->files);
+    free(listing->path);
+    free(listing);
+}
+
+static int host_file_prefetchable(struct host_file* hf)
+{
+    return S_ISREG(hf->st.st_mode) && hf->st.st_size != 0 && hf->st.st_size <= PREFETCH_MAX_FILE;
+}
+
+// Queue the listing of 'hostdir', then those of its subdirectories
+static void scanner_walk(struct build* b, char* hostdir)
+{
+    struct host_listing* listing = scan_host_dir(b, hostdir);
+
+    // Remember the subdirectories now, since the main thread frees the listing once it's done with it
+    char** subdirs = malloc((listing->count ? listing->count : 1) * sizeof(char*));
+    int nsubdirs = 0;
+    for (int i = 0; i < listing->count; i++)
+        if (S_ISDIR(listing->files[i].st.st_mode))
+            subdirs[nsubdirs++] = strdup(listing->files[i].path);
+
+    pthread_mutex_lock(&b->pipeline_lock);
+    if (hpfs_failed(b->vol)) {
+        // The main thread has given up, so nothing is going to take this listing, and there's no point going on
+        pthread_mutex_unlock(&b->pipeline_lock);
+        free_host_listing(listing);
+        for (int i = 0; i < nsubdirs; i++)
+            free(subdirs[i]);
+        free(subdirs);
+        return;
+    }
+    for (int i = 0; i < listing->count; i++) {
+        struct host_file* hf = &listing->files[i];
+        if (!host_file_prefetchable(hf))
+            continue;
+        // prefetch_tail is only valid while prefetch_next isn't NULL; everything before prefetch_next may be freed
+        if (b->prefetch_next)
+            b->prefetch_tail->next = hf;
+        else
+            b->prefetch_next = hf;
+        b->prefetch_tail = hf;
+    }
+    if (b->listing_tail)
+        b->listing_tail->next = listing;
+    else
+        b->listing_head = listing;
+    b->listing_tail = listing;
+    pthread_cond_broadcast(&b->reader_cond);
+    pthread_cond_signal(&b->pipeline_cond);
+    pthread_mutex_unlock(&b->pipeline_lock);
+
+    for (int i = 0; i < nsubdirs; i++) {
+        scanner_walk(b, subdirs[i]);
+        free(subdirs[i]);
+    }
+    free(subdirs);
+}
+
+static void* scanner_thread(void* arg)
+{
+    struct build* b = arg;
+    scanner_walk(b, b->scan_root);
+    pthread_mutex_lock(&b->pipeline_lock);
+    b->scan_done = 1;
+    pthread_cond_broadcast(&b->reader_cond);
+    pthread_mutex_unlock(&b->pipeline_lock);
+    return NULL;
+}
+
+// Files are claimed strictly in queue order, and only when there is buffer space for them. The file the main thread
+// needs next is always the oldest unfinished one, so it can never be starved of buffer space by files behind it.
+static void* reader_thread(void* arg)
+{
+    struct build* b = arg;
+    pthread_mutex_lock(&b->pipeline_lock);
+    for (;;) {
+        struct host_file* hf;
+        while (!(hf = b->prefetch_next) || b->prefetch_bytes + hf->st.st_size > PREFETCH_BYTES) {
+            if ((!hf && b->scan_done) || hpfs_failed(b->vol)) {
+                pthread_mutex_unlock(&b->pipeline_lock);
+                return NULL;
+            }
+            pthread_cond_wait(&b->reader_cond, &b->pipeline_lock);
+        }
+        b->prefetch_next = hf->next;
+        b->prefetch_bytes += hf->st.st_size;
+        pthread_mutex_unlock(&b->pipeline_lock);
+
+        uint32_t size = hf->st.st_size, len = 0;
+        uint8_t* data = malloc((size + 511) & ~511);
+        int fd2 = open(hf->path, O_RDONLY);
+        if (fd2 < 0)
+            build_fail(b, "open file: %s", strerror(errno));
+        while (len < size) {
+            ssize_t got = pread(fd2, data + len, size - len, len);
+            if (got < 0)
+                build_fail(b, "read file: %s", strerror(errno));
+            if (got == 0)
+                break; // File got shorter since we stat'ed it
+            len += got;
+        }
+        close(fd2);
+        memset(data + len, 0, ((size + 511) & ~511) - len);
+
+        pthread_mutex_lock(&b->pipeline_lock);
+        hf->data = data;
+        hf->data_len = len;
+        hf->prefetched = 1;
+        pthread_cond_signal(&b->pipeline_cond);
+    }
+}
+
+static void pipeline_start(struct build* b, char* hostdir)
+{
+    b->pipeline_tids = malloc((b->pipeline_threads + 1) * sizeof(pthread_t));
+    for (int i = 0; i < b->pipeline_threads; i++) {
+        if (pthread_create(&b->pipeline_tids[b->pipeline_tid_count], NULL, reader_thread, b))
+            build_fail(b, "Unable to create reader thread");
+        b->pipeline_tid_count++;
+    }
+    if (!b->plan_layout) { // Otherwise everything has been scanned already
+        b->scan_root = hostdir;
+        if (pthread_create(&b->pipeline_tids[b->pipeline_tid_count], NULL, scanner_thread, b))
+            build_fail(b, "Unable to create scanner thread");
+        b->pipeline_tid_count++;
+    }
+}
+// Wait for the scanner and the readers to finish. The tree has been built by now (or the build has failed), so there's
+// nothing left for them to do.
+static void pipeline_stop(struct build* b)
+{
+    pthread_mutex_lock(&b->pipeline_lock);
+    pthread_cond_broadcast(&b->reader_cond);
+    pthread_mutex_unlock(&b->pipeline_lock);
+    for (int i = 0; i < b->pipeline_tid_count; i++)
+        pthread_join(b->pipeline_tids[i], NULL);
+    free(b->pipeline_tids);
+    b->pipeline_tids = NULL;
+    b->pipeline_tid_count = 0;
+}
+
+// Get the sorted contents of host directory 'hostdir', either from the scanner thread or by reading it ourselves
+static struct host_listing* get_host_listing(struct build* b, char* hostdir)
+{
+    if (!b->pipeline_threads && !b->plan_layout)
+        return scan_host_dir(b, hostdir);
+
+    pthread_mutex_lock(&b->pipeline_lock);
+    while (!b->listing_head && !hpfs_failed(b->vol))
+        pthread_cond_wait(&b->pipeline_cond, &b->pipeline_lock);
+    if (!b->listing_head) {
+        pthread_mutex_unlock(&b->pipeline_lock);
+        build_fail(b, NULL);
+    }
+    struct host_listing* listing = b->listing_head;
+    if (!(b->listing_head = listing->next))
+        b->listing_tail = NULL;
+    pthread_mutex_unlock(&b->pipeline_lock);
+
+    if (strcmp(listing->path, hostdir)) {
+        fprintf(stderr, "Host tree scan out of order: expected '%s', got '%s'\n", hostdir, listing->path);
+        abort();
+    }
+    return listing;
+}
+
+// Wait for a file's prefetched contents. Returns NULL if the main thread has to copy it itself.
+static uint8_t* get_host_file_data(struct build* b, struct host_file* hf)
+{
+    if (!b->pipeline_threads || !host_file_prefetchable(hf))
+        return NULL;
+    pthread_mutex_lock(&b->pipeline_lock);
+    while (!hf->prefetched && !hpfs_failed(b->vol))
+        pthread_cond_wait(&b->pipeline_cond, &b->pipeline_lock);
+    pthread_mutex_unlock(&b->pipeline_lock);
+    if (!hf->prefetched)
+        build_fail(b, NULL);
+    return hf->data;
+}
+
+static void put_host_file_data(struct build* b, struct host_file* hf)
+{
+    free(hf->data);
+    hf->data = NULL;
+    b->prefetch_stats.bytes += hf->data_len;
+    b->prefetch_stats.files++;
+    pthread_mutex_lock(&b->pipeline_lock);
+    b->prefetch_bytes -= hf->st.st_size;
+    pthread_cond_broadcast(&b->reader_cond);
+    pthread_mutex_unlock(&b->pipeline_lock);
+}
+
+// ============================================================================
+// Planned layout
+// ============================================================================
+// With -l, the whole host tree is scanned before anything is allocated. Every FNODE and every byte of file data then
+// gets its place in one go, in the same order the directories are built: each file is its FNODE immediately followed
+// by its data, and a subdirectory's FNODE sits among its parent's files. DIRBLKs still come out of the dirband. Building
+// the metadata doesn't touch file data at all; once it's done, the data is copied in ascending LBA order, so the image
+// is written front to back.
+
+static void plan_add_extent(struct build* b, uint32_t logical, uint32_t sec, uint32_t count)
+{
+    if (b->plan_extent_count == b->plan_extent_capacity) {
+        b->plan_extent_capacity = b->plan_extent_capacity ? b->plan_extent_capacity << 1 : 1024;
+        b->plan_extent_list = realloc(b->plan_extent_list, b->plan_extent_capacity * sizeof(struct hpfs_alleaf));
+    }
+    struct hpfs_alleaf* ext = &b->plan_extent_list[b->plan_extent_count++];
+    ext->logical_lba = logical;
+    ext->physical_lba = sec;
+    ext->run_size = count;
+}
+
+// Reserve a FNODE followed by data_secs sectors of data for hf. The first free run that can hold both in one piece is
+// used. If no run is that long, or in_order is set, they're spread over consecutive runs from the start of free space
+// instead, which never leaves a hole behind.
+static void plan_file(struct build_thread* t, struct host_file* hf, uint32_t data_secs, int in_order)
+{
+    struct build* b = t->b;
+    uint32_t limit = b->vol->superblock->sectors_in_partition;
+    hf->plan_extent = b->plan_extent_count;
+    b->plan_stats.fnodes++;
+    b->plan_stats.data_sectors += data_secs;
+
+    // With -A, the data has to start on an aligned sector, so the FNODE goes right in front of one. A profile is meant to
+    // be read in one go, so in_order doesn't bother.
+    uint32_t sec = -1, align = data_align_for(b, data_secs);
+    if (in_order)
+        ;
+    else if (align == 1 || !data_secs)
+        sec = hpfs_bitmap_alloc(b->vol->blk_bitmaps, &b->plan_cursor, 1 + data_secs, limit, 1);
+    else {
+        uint32_t s = b->plan_cursor = hpfs_bitmap_find_free(b->vol->blk_bitmaps, b->plan_cursor, limit);
+        while (s < limit) {
+            s = ((s + align) & ~(align - 1)) - 1;
+            if (s >= limit)
+                break;
+            uint32_t run = hpfs_bitmap_run_length(b->vol->blk_bitmaps, s, 1 + data_secs, limit);
+            if (run == 1 + data_secs) {
+                hpfs_bitmap_fill(b->vol->blk_bitmaps, s, run, 0);
+                sec = s;
+                break;
+            }
+            s = hpfs_bitmap_find_free(b->vol->blk_bitmaps, s + run, limit);
+        }
+    }
+    if (sec != (uint32_t)-1) {
+        extent_index_carve(b, sec, 1 + data_secs);
+        align_note_padding(t, sec, 1 + data_secs, align);
+        hf->plan_sector = sec;
+        if (data_secs)
+            plan_add_extent(b, 0, sec + 1, data_secs);
+        hf->plan_extents = b->plan_extent_count - hf->plan_extent;
+        return;
+    }
+
+    if (!in_order)
+        b->plan_stats.split++;
+    uint32_t left = 1 + data_secs, logical = 0;
+    sec = b->plan_cursor;
+    while (left) {
+        sec = hpfs_bitmap_find_free(b->vol->blk_bitmaps, sec, limit);
+        uint32_t run = hpfs_bitmap_run_length(b->vol->blk_bitmaps, sec, left, limit);
+        if (run == 0)
+            build_fail(b, "Out of space on volume (tried to allocate %d sectors)", data_secs + 1);
+        mark_sectors_used(b, sec, run);
+        left -= run;
+        if (!hf->plan_sector) {
+            hf->plan_sector = sec++;
+            run--;
+        }
+        if (run) {
+            plan_add_extent(b, logical, sec, run);
+            logical += run;
+        }
+        sec += run;
+    }
+    hf->plan_extents = b->plan_extent_count - hf->plan_extent;
+}
+
+static int profile_lookup(struct build* b, struct host_file* hf);
+
+static int plan_file_compare(const void* a, const void* b)
+{
+    uint32_t x = (*(struct host_file* const*)a)->plan_sector, y = (*(struct host_file* const*)b)->plan_sector;
+    return x < y ? -1 : x > y;
+}
+
+// Scan the host tree and decide where everything in it goes
+static void plan_run(struct build_thread* t, char* hostdir)
+{
+    struct build* b = t->b;
+    // This queues up every listing in the order add_host_dir will ask for them
+    scanner_walk(b, hostdir);
+    b->scan_done = 1;
+    for (struct host_listing* listing = b->listing_head; listing; listing = listing->next) {
+        b->plan_listings = realloc(b->plan_listings, (b->plan_listing_count + 1) * sizeof(struct host_listing*));
+        b->plan_listings[b->plan_listing_count++] = listing;
+    }
+
+    for (uint32_t l = 0; l < b->plan_listing_count; l++) {
+        struct host_listing* listing = b->plan_listings[l];
+        // Files first, then subdirectories, just like add_host_dir
+        for (int pass = 0; pass < 2; pass++)
+            for (int i = 0; i < listing->count; i++) {
+                struct host_file* hf = &listing->files[i];
+                if ((S_ISDIR(hf->st.st_mode) != 0) != pass)
+                    continue;
+                if (!profile_lookup(b, hf)) // Files in the profile have their place already
+                    plan_file(t, hf, pass ? 0 : (hf->st.st_size + 511) >> 9, 0);
+                if (!pass && hf->st.st_size) {
+                    if (b->shadow_bitmaps) {
+                        uint32_t shadow_extents = shadow_first_fit(b, (hf->st.st_size + 511) >> 9);
+                        b->alloc_stats.shadow_extents += shadow_extents;
+                        b->alloc_stats.shadow_fragmented += shadow_extents > 1;
+                    }
+                    b->plan_files = realloc(b->plan_files, (b->plan_file_count + 1) * sizeof(struct host_file*));
+                    b->plan_files[b->plan_file_count++] = hf;
+                }
+            }
+    }
+
+    // First-fit can put a small file into space that an earlier, bigger file skipped over, so the copy order has to be
+    // sorted. The reader threads have to prefetch in the same order.
+    qsort(b->plan_files, b->plan_file_count, sizeof(struct host_file*), plan_file_compare);
+    b->prefetch_next = b->prefetch_tail = NULL;
+    for (uint32_t i = 0; i < b->plan_file_count; i++) {
+        struct host_file* hf = b->plan_files[i];
+        if (!host_file_prefetchable(hf))
+            continue;
+        hf->next = NULL;
+        if (b->prefetch_next)
+            b->prefetch_tail->next = hf;
+        else
+            b->prefetch_next = hf;
+        b->prefetch_tail = hf;
+    }
+}
+
+// Copy a planned file's data into the extents reserved for it
+static void plan_copy_file(struct build* b, struct host_file* hf)
+{
+    uint8_t* data = get_host_file_data(b, hf);
+    int fd2 = -1;
+    if (!data && (fd2 = open(hf->path, O_RDONLY)) < 0)
+        build_fail(b, "open file: %s", strerror(errno));
+    for (uint32_t j = 0; j < hf->plan_extents; j++) {
+        struct hpfs_alleaf* ext = &b->plan_extent_list[hf->plan_extent + j];
+        uint64_t file_offset = (uint64_t)ext->logical_lba << 9, extent_bytes = (uint64_t)ext->run_size << 9;
+        if (file_offset + extent_bytes > (uint64_t)hf->st.st_size)
+            extent_bytes = hf->st.st_size - file_offset;
+        if (data)
+            write_file_data(b, data + file_offset, ext->physical_lba, extent_bytes);
+        else
+            copy_file_data(b, fd2, file_offset, ext->physical_lba, extent_bytes);
+    }
+    if (data) {
+        b->bytes_copied += hf->data_len;
+        put_host_file_data(b, hf);
+    } else
+        close(fd2);
+}
+
+// Copy every planned file's data into place, front to back
+static void plan_copy_data(struct build* b)
+{
+    for (uint32_t i = 0; i < b->plan_file_count; i++)
+        plan_copy_file(b, b->plan_files[i]);
+
+    for (uint32_t i = 0; i < b->plan_listing_count; i++)
+        free_host_listing(b->plan_listings[i]);
+    free(b->plan_listings);
+    free(b->plan_files);
+    b->plan_listings = NULL;
+    b->plan_files = NULL;
+    b->plan_listing_count = b->plan_file_count = 0;
+    fprintf(stderr, "Planned layout: %u FNODEs, %llu data sectors, %u files split over more than one free run\n",
+        b->plan_stats.fnodes, (unsigned long long)b->plan_stats.data_sectors, b->plan_stats.split);
+}
+
+// ============================================================================
+// Placement profile
+// ============================================================================
+// With -b, the files named in a profile are laid out before anything else, in the order they're listed, starting at the
+// beginning of free space: each one's FNODE, then its data. Files that are read one after another at boot time can then
+// be read in a single sweep. The rest of the tree is added around them as usual.
+//
+// A profile has one path per line, relative to the -d directory, using either slash. Blank lines and lines starting
+// with '#' are ignored.
+
+static int profile_path_compare(const void* a, const void* b)
+{
+    return strcmp((*(struct host_file* const*)a)->path, (*(struct host_file* const*)b)->path);
+}
+
+// Read the profile and reserve space for every file in it
+static void profile_load(struct build_thread* t, char* profile, char* hostdir)
+{
+    struct build* b = t->b;
+    FILE* f = fopen(profile, "r");
+    if (!f)
+        build_fail(b, "open profile: %s", strerror(errno));
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        char* name = line;
+        name[strcspn(name, "\r\n")] = 0;
+        while (*name == '/' || *name == '\\' || *name == ' ' || *name == '\t')
+            name++;
+        if (!*name || *name == '#')
+            continue;
+        for (char* c = name; *c; c++)
+            if (*c == '\\')
+                *c = '/';
+
+        // Build the path the same way scan_host_dir does, so that profile_lookup can match it
+        b->profile_files = realloc(b->profile_files, (b->profile_count + 1) * sizeof(struct host_file));
+        struct host_file* hf = &b->profile_files[b->profile_count];
+        memset(hf, 0, sizeof(struct host_file));
+        hf->path = malloc(strlen(hostdir) + 1 + strlen(name) + 1);
+        concatpath(hf->path, hostdir, strlen(hostdir), name);
+        hf->name = hf->path + strlen(hf->path) - strlen(name);
+
+        int duplicate = 0;
+        for (uint32_t i = 0; i < b->profile_count; i++)
+            duplicate |= !strcmp(b->profile_files[i].path, hf->path);
+        if (duplicate || stat(hf->path, &hf->st) || !S_ISREG(hf->st.st_mode) || hf->st.st_size > UINT32_MAX) {
+            fprintf(stderr, "Profile: skipping '%s' (%s)\n", name, duplicate ? "listed twice" : "not a regular file in the tree");
+            free(hf->path);
+            continue;
+        }
+        b->profile_count++;
+    }
+    fclose(f);
+
+    b->profile_sorted = malloc((b->profile_count ? b->profile_count : 1) * sizeof(struct host_file*));
+    b->profile_matched = calloc(b->profile_count ? b->profile_count : 1, 1);
+    for (uint32_t i = 0; i < b->profile_count; i++) {
+        plan_file(t, &b->profile_files[i], (b->profile_files[i].st.st_size + 511) >> 9, 1);
+        b->profile_sorted[i] = &b->profile_files[i];
+    }
+    qsort(b->profile_sorted, b->profile_count, sizeof(struct host_file*), profile_path_compare);
+}
+
+// If hf is in the profile, give it the space that was reserved for it. Returns nonzero if it was.
+static int profile_lookup(struct build* b, struct host_file* hf)
+{
+    if (!b->profile_count)
+        return 0;
+    struct host_file** found = bsearch(&hf, b->profile_sorted, b->profile_count, sizeof(struct host_file*), profile_path_compare);
+    if (!found)
+        return 0;
+    b->profile_matched[*found - b->profile_files] = 1;
+    hf->plan_sector = (*found)->plan_sector;
+    hf->plan_extent = (*found)->plan_extent;
+    hf->plan_extents = (*found)->plan_extents;
+    return 1;
+}
+
+// Give back the space reserved for profile files that the tree never got to, such as a path that only matches the
+// host's file system because of a symlink or a "./" in it
+static void profile_release_unmatched(struct build* b)
+{
+    int released = 0;
+    for (uint32_t i = 0; i < b->profile_count; i++) {
+        struct host_file* hf = &b->profile_files[i];
+        if (b->profile_matched[i])
+            continue;
+        fprintf(stderr, "Profile: '%s' was never added to the image, so its space is left free\n", hf->name);
+        hpfs_bitmap_fill(b->vol->blk_bitmaps, hf->plan_sector, 1, 1);
+        for (uint32_t j = 0; j < hf->plan_extents; j++) {
+            struct hpfs_alleaf* ext = &b->plan_extent_list[hf->plan_extent + j];
+            hpfs_bitmap_fill(b->vol->blk_bitmaps, ext->physical_lba, ext->run_size, 1);
+        }
+        hf->plan_extents = 0;
+        released = 1;
+    }
+    if (released)
+        extent_index_rebuild(b);
+}
+
+// Print where every profile file ended up, and how much of the range they cover is theirs
+static void profile_report(struct build* b)
+{
+    uint32_t first = -1, last = 0;
+    uint64_t used = 0;
+    uint32_t placed = 0;
+    for (uint32_t i = 0; i < b->profile_count; i++) {
+        struct host_file* hf = &b->profile_files[i];
+        if (!b->profile_matched[i])
+            continue;
+        placed++;
+        uint32_t start = hf->plan_sector, end = start + 1;
+        printf("%s:", hf->name);
+        for (uint32_t j = 0; j <= hf->plan_extents; j++) {
+            struct hpfs_alleaf* ext = j < hf->plan_extents ? &b->plan_extent_list[hf->plan_extent + j] : NULL;
+            if (ext && ext->physical_lba == end) {
+                end += ext->run_size;
+                continue;
+            }
+            printf(" %u-%u", start, end - 1);
+            used += end - start;
+            first = start < first ? start : first;
+            last = end - 1 > last ? end - 1 : last;
+            if (ext) {
+                start = ext->physical_lba;
+                end = start + ext->run_size;
+            }
+        }
+        printf("\n");
+    }
+    if (placed)
+        printf("Profile: %u files in sectors %u-%u, %llu of %u sectors used by the profile\n",
+            placed, first, last, (unsigned long long)used, last - first + 1);
+}
+
+// ============================================================================
+// Host tree import
+// ============================================================================
+
+// Create the FNODE (and file data or subdirectory) for host file 'hf', and fill in its dirent in 'de'.
+// The containing directory's FNODE is at dir_fnode_lba. Returns the first sector of file data, or 0 if there isn't any.
+static uint32_t add_host_dirent(struct build_thread* t, uint32_t dir_fnode_lba, struct host_file* hf, struct hpfs_dirent* de)
+{
+    struct build* b = t->b;
+    char* name = hf->name;
+    int p2l = strlen(name);
+
+    if (p2l > 254) {
+        fprintf(stderr, "Name '%s' is too long to fit in a HPFS volume. Truncating to first 254 characters.\n", name);
+        p2l = 254;
+    }
+
+    uint8_t attr = stat2attr(&hf->st);
+    if (is_longname(name))
+        attr |= HPFS_DIRENT_ATTR_LONGNAME;
+
+    // Create fnode and populate it.
+    if (!b->plan_layout)
+        profile_lookup(b, hf);
+    uint32_t lba = hf->plan_sector;
+    size_class_select(t, S_ISDIR(hf->st.st_mode) ? 0 : hf->st.st_size);
+    struct hpfs_fnode* fn = hpfs_new_fnode(t, dir_fnode_lba, &lba);
+    fn->dir_flag = (attr & HPFS_DIRENT_ATTR_DIRECTORY) != 0;
+    fn->filelen = hf->st.st_size;
+    fn->namelen = p2l;
+    fn->btree_info_flag = 0;
+    fn->free_entries = HPFS_ALLEAFS_PER_FNODE;
+    fn->free_entry_offset = sizeof(struct hpfs_btree_header); // 0x40 is the beginning of the internal AL* table
+    int offset = p2l - 15;
+    if (offset < 0)
+        offset = 0;
+    memcpy(fn->name15, &name[offset], p2l >= 15 ? 15 : p2l);
+
+#if 0
+    fprintf(stderr, "%s\n", name);
+    if (strcmp("softfloat.c", name) == 0)
+        __asm__("int3");
+#endif
+
+    // Create dirent and fnode
+    // The Linux HPFS driver doesn't like it when the downlink space is reserved ahead of time.
+    de->size = (0x1F + /*4 + */ p2l + 3) & ~3; // (sizeof dirent_header + /*sizeof downlink */+ sizeof name + rounding_fudge) & ~3
+    de->atime
+        = de->ctime = de->mtime = b->now;
+    de->attributes = attr;
+    de->code_page_index = 0;
+    de->ea_size = 0;
+    de->filelen = hf->st.st_size;
+    de->flags = 0; // will be filled in later
+    de->flex = 0;
+    de->fnode_lba = lba;
+    de->namelen = p2l;
+    memcpy(de->name_stuff, name, p2l);
+    //SET_DOWNLINK(de, 0);
+
+    if (attr & HPFS_DIRENT_ATTR_DIRECTORY) {
+        struct hpfs_dirblk* newdir = add_host_dir(t, lba, dir_fnode_lba, hf->path);
+
+        // Attach this dirblk to the fnode
+        fn->btree_info_flag = 0; // ALLEAFs
+        fn->alleafs[0].logical_lba = 0;
+        fn->alleafs[0].physical_lba = newdir->this_lba;
+        fn->alleafs[0].run_size = 0;
+        fn->alleafs[1].logical_lba = -1;
+    } else {
+        // Add file data, if necessary.
+        //if (strcmp(host_de->d_name, "a.zip") == 0)
+        if (hf->st.st_size != 0 && hf->plan_sector) {
+            // Everything's been allocated already. With -l, plan_copy_data fills in the data later.
+            hpfs_build_extent_tree(t, fn, lba, &b->plan_extent_list[hf->plan_extent], hf->plan_extents);
+            if (!b->plan_layout)
+                plan_copy_file(b, hf);
+            build_lock(b);
+            b->alloc_stats.files++;
+            b->alloc_stats.extents += hf->plan_extents;
+            b->alloc_stats.fragmented += hf->plan_extents > 1;
+            build_unlock(b);
+            return b->plan_extent_list[hf->plan_extent].physical_lba;
+        } else if (hf->st.st_size != 0) { // If we have zero-length files, then we just keep them as they are
+            uint32_t secs = (hf->st.st_size + 511) >> 9, offset = 0, extents = 0;
+            t->file_align = data_align_for(b, secs);
+            uint8_t* data = get_host_file_data(b, hf);
+            int fd2 = -1;
+            if (!data && (fd2 = open(hf->path, O_RDONLY)) < 0)
+                build_fail(b, "open file: %s", strerror(errno));
+            if (b->shadow_bitmaps) {
+                uint32_t shadow_extents = shadow_first_fit(b, secs);
+                b->alloc_stats.shadow_extents += shadow_extents;
+                b->alloc_stats.shadow_fragmented += shadow_extents > 1;
+            }
+            while (secs > 0) {
+                uint32_t x;
+#if 0 // set this to 1 if you want to try creating files with lots and lots of extents
+                uint32_t secloc = alloc_data_sectors(t, 1, &x);
+#else
+                uint32_t secloc = alloc_data_sectors(t, secs, &x);
+#endif
+                if (extents == t->file_extents_capacity) {
+                    t->file_extents_capacity = t->file_extents_capacity ? t->file_extents_capacity << 1 : 64;
+                    t->file_extents = realloc(t->file_extents, t->file_extents_capacity * sizeof(struct hpfs_alleaf));
+                }
+                t->file_extents[extents].logical_lba = offset;
+                t->file_extents[extents].physical_lba = secloc;
+                t->file_extents[extents].run_size = x;
+                extents++;
+
+                // Copy data from file
+                uint64_t file_offset = (uint64_t)offset << 9, extent_bytes = (uint64_t)x << 9;
+                if (file_offset + extent_bytes > (uint64_t)hf->st.st_size)
+                    extent_bytes = hf->st.st_size - file_offset;
+                if (data)
+                    write_file_data(b, data + file_offset, secloc, extent_bytes);
+                else
+                    copy_file_data(b, fd2, file_offset, secloc, extent_bytes);
+
+                secs -= x;
+                offset += x;
+            }
+            hpfs_build_extent_tree(t, fn, lba, t->file_extents, extents);
+            if (data) {
+                b->bytes_copied += hf->data_len;
+                put_host_file_data(b, hf);
+            } else
+                close(fd2);
+            build_lock(b);
+            b->alloc_stats.files++;
+            b->alloc_stats.extents += extents;
+            b->alloc_stats.fragmented += extents > 1;
+            build_unlock(b);
+            //abort();
+            return t->file_extents[0].physical_lba;
+        }
+    }
+    return 0;
+}
+
+// ============================================================================
+// Parallel subtree construction
+// ============================================================================
+// With -t N, the subdirectories of the root are built by N threads at once. Each one is a job: the subdirectory's FNODE,
+// everything under it, and the dirent the root will get for it. Jobs are dealt out round-robin, and a thread that runs
+// out takes the last job of whichever thread has the most left. Once they're all done, the main thread adds the dirents
+// to the root directory in order. Which bands a subtree ends up in depends on timing, so these images aren't
+// reproducible byte for byte.
+
+struct build_job {
+    struct host_file* hf;
+    struct hpfs_dirent* de;
+};
+struct build_worker {
+    pthread_t thread;
+    struct build_thread t;
+    struct build_job** jobs;
+    int head, tail;
+};
+
+// Take over what a builder allocated its structures from, and add its statistics to ours
+static void build_thread_merge(struct build_thread* t, struct build_thread* from)
+{
+    arena_merge(&t->sector_arena, &from->sector_arena);
+    arena_merge(&t->dirblk_arena, &from->dirblk_arena);
+    for (int i = 0; i <= SECTOR_ENTRY_DATA; i++)
+        t->arena_type_bytes[i] += from->arena_type_bytes[i];
+    t->locality_stats.distance += from->locality_stats.distance;
+    t->locality_stats.files += from->locality_stats.files;
+}
+
+static struct build_job* build_next_job(struct build* b, struct build_worker* self)
+{
+    struct build_job* job = NULL;
+    pthread_mutex_lock(&b->build_lock_mutex);
+    if (hpfs_failed(b->vol))
+        ; // Another builder has given up, so there's no point in the rest
+    else if (self->head < self->tail)
+        job = self->jobs[self->head++];
+    else {
+        struct build_worker* victim = NULL;
+        for (int i = 0; i < b->build_threads; i++) {
+            struct build_worker* w = &b->build_workers[i];
+            if (w->tail - w->head > (victim ? victim->tail - victim->head : 0))
+                victim = w;
+        }
+        if (victim)
+            job = victim->jobs[--victim->tail];
+    }
+    pthread_mutex_unlock(&b->build_lock_mutex);
+    return job;
+}
+
+static void* build_thread(void* arg)
+{
+    struct build_worker* self = arg;
+    struct build_thread* t = &self->t;
+    struct build_job* job;
+    t->in_builder = 1;
+    while ((job = build_next_job(t->b, self)))
+        add_host_dirent(t, t->b->build_dir_fnode, job->hf, job->de);
+    return NULL;
+}
+
+// Build all the subdirectories in 'listing' at once and add them to 'dirblk'
+static void add_host_subtrees(struct build_thread* t, struct hpfs_dirblk* dirblk, struct host_listing* listing)
+{
+    struct build* b = t->b;
+    int count = 0;
+    for (int i = 0; i < listing->count; i++)
+        count += S_ISDIR(listing->files[i].st.st_mode) != 0;
+    if (!count)
+        return;
+
+    struct build_job* jobs = malloc(count * sizeof(struct build_job));
+    uint8_t* buf = calloc(count, 0x124);
+    b->build_workers = calloc(b->build_threads, sizeof(struct build_worker));
+    for (int i = 0; i < b->build_threads; i++) {
+        b->build_workers[i].jobs = malloc(count * sizeof(struct build_job*));
+        build_thread_init(&b->build_workers[i].t, b);
+    }
+    for (int i = 0, j = 0; i < listing->count; i++) {
+        if (!S_ISDIR(listing->files[i].st.st_mode))
+            continue;
+        jobs[j].hf = &listing->files[i];
+        jobs[j].de = (struct hpfs_dirent*)(buf + j * 0x124);
+        struct build_worker* w = &b->build_workers[j % b->build_threads];
+        w->jobs[w->tail++] = &jobs[j++];
+    }
+
+    b->build_dir_fnode = dirblk->parent_lba; // dirblk is the top of the tree, so its parent is the directory FNODE
+    b->build_parallel = 1;
+    int started = 0;
+    while (started < b->build_threads && !pthread_create(&b->build_workers[started].thread, NULL, build_thread, &b->build_workers[started]))
+        started++;
+    if (started < b->build_threads)
+        hpfs_error(b->vol, "Unable to create builder thread"); // The ones that did start see this and stop
+    for (int i = 0; i < started; i++)
+        pthread_join(b->build_workers[i].thread, NULL);
+    b->build_parallel = 0;
+
+    for (int i = 0; i < b->build_threads; i++) {
+        free(b->build_workers[i].jobs);
+        build_thread_merge(t, &b->build_workers[i].t);
+        build_thread_free(&b->build_workers[i].t);
+    }
+    free(b->build_workers);
+    b->build_workers = NULL;
+    if (hpfs_failed(b->vol)) {
+        free(buf);
+        free(jobs);
+        build_fail(b, NULL);
+    }
+    if (b->alloc_policy != HPFSIMG_ALLOC_FIRST_FIT)
+        extent_index_rebuild(b);
+
+    for (int j = 0; j < count; j++)
+        hpfs_add_dirent(t, dirblk, jobs[j].de);
+
+    free(buf);
+    free(jobs);
+}
+
+// Add references to files in host directory 'hostdir' into in-image 'dirblk', which is already on disk
+static int add_host_files(struct build_thread* t, struct hpfs_dirblk* dirblk, char* hostdir)
+{
+    struct build* b = t->b;
+    // We need to run the following steps:
+    // For each element in the directory:
+    //  Add dirent (splitting as needed)
+    //  Attach fnode to dirent
+    struct host_listing* listing = get_host_listing(b, hostdir);
+
+    if (!t->temp_addfiles_de)
+        t->temp_addfiles_de = calloc(1, 0x124);
+
+    // Files first, then subdirectories (see the comment at the top of the pipeline section)
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass && b->build_threads) {
+            add_host_subtrees(t, dirblk, listing);
+            break;
+        }
+        for (int i = 0; i < listing->count; i++) {
+            if ((S_ISDIR(listing->files[i].st.st_mode) != 0) != pass)
+                continue;
+            // dirblk is the top of the tree, so its parent is the directory FNODE
+            uint32_t data_sec = add_host_dirent(t, dirblk->parent_lba, &listing->files[i], t->temp_addfiles_de);
+            if (data_sec)
+                locality_add(t, node_sector(b, dirblk->this_lba), data_sec);
+            hpfs_add_dirent(t, dirblk, t->temp_addfiles_de);
+        }
+    }
+    if (!b->plan_layout)
+        free_host_listing(listing);
+    return 0;
+}
+
+// Create a new directory in the image containing everything in host directory 'hostdir', and return its top DIRBLK.
+// The directory's FNODE is at fnode_lba, and its parent's FNODE is at parent_fnode_lba.
+static struct hpfs_dirblk* add_host_dir(struct build_thread* t, uint32_t fnode_lba, uint32_t parent_fnode_lba, char* hostdir)
+{
+    struct build* b = t->b;
+    struct host_listing* listing = get_host_listing(b, hostdir);
+    int count = listing->count;
+    uint32_t parent_home_band = t->home_band;
+    if (b->alloc_policy == HPFSIMG_ALLOC_BAND)
+        t->home_band = band_pick_home(b, t->home_band);
+
+    // Each dirent gets its own slot, in sorted order. The '..' entry always comes first.
+    uint8_t* buf = calloc(count + 1, 0x124);
+    struct hpfs_dirent** ents = malloc((count + 1) * sizeof(struct hpfs_dirent*));
+    for (int i = 0; i <= count; i++)
+        ents[i] = (struct hpfs_dirent*)(buf + i * 0x124);
+    hpfs_add_dotdot(b, ents[0], parent_fnode_lba);
+    uint32_t* data_secs = calloc(count + 1, sizeof(uint32_t));
+
+    // Files first, then subdirectories (see the comment at the top of the pipeline section)
+    for (int pass = 0; pass < 2; pass++)
+        for (int i = 0; i < count; i++)
+            if ((S_ISDIR(listing->files[i].st.st_mode) != 0) == pass)
+                data_secs[i] = add_host_dirent(t, fnode_lba, &listing->files[i], ents[i + 1]);
+    if (!b->plan_layout)
+        free_host_listing(listing);
+
+    struct hpfs_dirblk* top = hpfs_build_dirblk_tree(t, ents, count + 1, fnode_lba);
+    t->home_band = parent_home_band;
+    for (int i = 0; i < count; i++)
+        if (data_secs[i])
+            locality_add(t, node_sector(b, top->this_lba), data_secs[i]);
+
+    free(data_secs);
+    free(ents);
+    free(buf);
+    return top;
+}
+
+// ============================================================================
+// Entry points
+// ============================================================================
+// Everything above is driven from hpfsimg_populate, which hpfsimg and mkhpfs -d call.
+
+// Free everything a build was holding on to. If it failed, that includes whatever the pipeline hadn't handed over yet.
+static void build_free(struct build* b)
+{
+    extent_index_free(b->free_extents[TREE_BY_START]);
+    if (b->shadow_bitmaps) {
+        for (unsigned int i = 0; i < b->vol->bands; i++)
+            free(b->shadow_bitmaps[i]);
+        free(b->shadow_bitmaps);
+    }
+    free(b->align_holes);
+    for (int i = 0; i < MAX_SIZE_CLASSES; i++)
+        free(b->size_class_bands[i].band);
+    node_free(b);
+    // With -l, every listing is in plan_listings once the scan is done, and some of them are still queued as well
+    if (b->plan_listing_count)
+        for (uint32_t i = 0; i < b->plan_listing_count; i++)
+            free_host_listing(b->plan_listings[i]);
+    else
+        for (struct host_listing *listing = b->listing_head, *next; listing; listing = next) {
+            next = listing->next;
+            free_host_listing(listing);
+        }
+    free(b->plan_listings);
+    free(b->plan_files);
+    free(b->plan_extent_list);
+    for (uint32_t i = 0; i < b->profile_count; i++)
+        free(b->profile_files[i].path);
+    free(b->profile_files);
+    free(b->profile_sorted);
+    free(b->profile_matched);
+    free(b->rootdir_fnode);
+    free(b->rootdir);
+    build_thread_free(&b->main_thread);
+    pthread_mutex_destroy(&b->build_lock_mutex);
+    pthread_mutex_destroy(&b->pipeline_lock);
+    pthread_cond_destroy(&b->pipeline_cond);
+    pthread_cond_destroy(&b->reader_cond);
+    free(b);
+}
+
+static void casetbl_init(void)
+{
+    for (int i = 0; i < 256; i++) {
+        if (i >= 'a' && i <= 'z')
+            casetbl[i] = i - 'a' + 'A';
+        else
+            casetbl[i] = i;
+    }
+}
+
+// Everything hpfsimg_populate does, other than setting up and tearing down. This is where build_fail jumps out of.
+static void build_run(struct build* b, char* dir, struct hpfsimg_options* options)
+{
+    static struct hpfsimg_options defaults;
+    if (!options)
+        options = &defaults;
+    struct build_thread* t = &b->main_thread;
+    if (options->build_threads && (options->pipeline_threads || options->plan_layout))
+        build_fail(b, "Subtrees can't be built in parallel with the pipeline or a planned layout");
+    b->alloc_policy = options->alloc_policy;
+    b->size_class_limit[0] = 128;
+    b->size_class_count = 1;
+    if (options->size_classes) {
+        char* classes = strdup(options->size_classes); // strtok takes it apart
+        size_class_parse(b, classes);
+        free(classes);
+    }
+    b->data_align = options->data_align ? options->data_align : 1;
+    b->data_align_big = options->data_align_big;
+    b->profile_name = options->profile;
+    b->show_profile = options->show_profile;
+    b->show_free_frag = options->show_free_frag;
+    b->pipeline_threads = options->pipeline_threads;
+    b->build_threads = options->build_threads;
+    b->plan_layout = options->plan_layout;
+#ifndef __linux__
+    b->copy_file_range_broken = 1;
+#endif
+    // copy_file_range would have to wait for everything in flight, so queued writes go through write buffers instead
+    if (b->vol->queue_depth)
+        b->copy_file_range_broken = 1;
+
+    b->now = time(NULL);
+
+    // What we do here
+    //  - Create dirblk structures
+    //  - Populate image with data
+    //  - Write back all structures
+
+    // Build the free extent index now that we know what's free
+    alloc_init(b);
+
+    // Read dirblk fnode
+    if (!(b->rootdir_fnode = hpfs_get_ondisk_fnode(b, b->vol->superblock->rootdir_fnode)))
+        build_fail(b, "Unable to open root directory");
+    uint32_t rootdir_lba = FNODE_TO_DIRBLK_LBA(b->rootdir_fnode);
+    struct hpfs_dirblk* rootdir = b->rootdir = hpfs_get_ondisk_dirblk(b, rootdir_lba);
+    if (!rootdir)
+        build_fail(b, "Unable to open root directory");
+
+    // The root dirblk gets a node like every other dirblk, since splitting one of its children has to find it.
+    // Anything below it is still on disk and has no node, so we can only add to a root directory that fits in one DIRBLK.
+    DIRBLK_ITER(cur, rootdir)
+    {
+        if (cur->flags & HPFS_DIRENT_FLAGS_BTREE)
+            build_fail(b, "Root directory has more than one DIRBLK. Only freshly formatted images are supported");
+    }
+    node_init(b);
+    rootdir->this_lba = node_add(b, rootdir_lba, SECTOR_ENTRY_DIRBLK, rootdir);
+    t->home_band = rootdir_lba >> 14;
+    if (b->profile_name)
+        profile_load(t, b->profile_name, dir);
+    if (b->plan_layout)
+        plan_run(t, dir);
+    if (b->pipeline_threads)
+        pipeline_start(b, dir);
+    add_host_files(t, rootdir, dir);
+    if (b->pipeline_threads) {
+        pipeline_stop(b);
+        build_check(b); // A reader might have given up on a file we never waited for
+    }
+    if (b->plan_layout)
+        plan_copy_data(b);
+    profile_release_unmatched(b);
+
+    // Queue up every node, the dirband bitmap, and the band bitmaps, then write them all out in LBA order
+    nodes_serialize(b);
+    for (uint32_t i = 1; i < b->nodes_used; i++)
+        node_writeback(b, node_at(b, i));
+    hpfs_queue_bitmaps(b->vol);
+    if (hpfs_flush_writes(b->vol))
+        build_fail(b, NULL);
+    fprintf(stderr, "Wrote %d metadata sectors in %d runs\n", b->vol->flushed_sectors, b->vol->flushed_runs);
+    alloc_report(b); // Still needs the bitmaps
+    if (b->show_free_frag)
+        free_frag_report(b);
+    if (b->show_profile)
+        profile_report(b);
+    arena_report(b);
+    fprintf(stderr, "Copied %llu bytes of file data%s\n", (unsigned long long)b->bytes_copied, b->copy_file_range_broken ? "" : " with copy_file_range");
+    if (b->pipeline_threads)
+        fprintf(stderr, "Prefetched %llu bytes in %u files with %d reader threads\n", (unsigned long long)b->prefetch_stats.bytes, b->prefetch_stats.files, b->pipeline_threads);
+}
+
+// Run the build, and come back here if it fails
+static void build_try(struct build* b, char* dir, struct hpfsimg_options* options)
+{
+    if (!setjmp(b->fail_jump))
+        build_run(b, dir, options);
+    else if (b->pipeline_tids)
+        pipeline_stop(b); // The readers and the scanner see that the build failed, and stop
+}
+
+int hpfsimg_populate(struct hpfs_volume* vol, char* dir, struct hpfsimg_options* options)
+{
+    if (hpfs_failed(vol))
+        return -1;
+    pthread_once(&casetbl_once, casetbl_init);
+
+    struct build* b = calloc(1, sizeof(struct build));
+    b->vol = vol;
+    build_thread_init(&b->main_thread, b);
+    b->main_tid = pthread_self();
+    b->treap_seed = 0x2545F491;
+    b->size_class_next_band = 1;
+    pthread_mutex_init(&b->build_lock_mutex, NULL);
+    pthread_mutex_init(&b->pipeline_lock, NULL);
+    pthread_cond_init(&b->pipeline_cond, NULL);
+    pthread_cond_init(&b->reader_cond, NULL);
+    build_try(b, dir, options);
+    build_free(b);
+    return hpfs_failed(vol) ? -1 : 0;
+}
@@ -0,0 +1,35 @@
+// The part of hpfsimg that copies a host directory onto a volume, for tools that want to do that themselves
+#ifndef POPULATE_H
+#define POPULATE_H
+
+#include "libhpfs.h"
+
+// File data allocation policies (hpfsimg -a)
+enum {
+    HPFSIMG_ALLOC_BEST_FIT,
+    HPFSIMG_ALLOC_FIRST_FIT,
+    HPFSIMG_ALLOC_BAND,
+    HPFSIMG_ALLOC_SIZE_CLASS
+};
+
+// hpfsimg's command line options. Leaving a field zero (or passing no options at all) gives the default.
+struct hpfsimg_options {
+    int alloc_policy; // -a
+    char* size_classes; // -c, a comma-separated list of bounds in KB
+    uint32_t data_align, data_align_big; // -A, in sectors
+    char* profile; // -b
+    int show_profile; // -r
+    int show_free_frag; // -f
+    int pipeline_threads; // -j
+    int build_threads; // -t
+    int plan_layout; // -l
+};
+
+// Copy dir and everything in it into the root directory of vol. The superblock, spareblock and bitmaps have to be in
+// memory already, and the root directory has to be freshly formatted. Everything is written back (bitmaps included)
+// before this returns, but vol is left open. Returns 0, or -1 with the reason in vol->error (see hpfs_error); the image
+// is left half-written then, and a little memory may have leaked.
+// Everything a call works with is its own, so any number of threads can each be populating a different volume at once.
+int hpfsimg_populate(struct hpfs_volume* vol, char* dir, struct hpfsimg_options* options);
+
+#endif